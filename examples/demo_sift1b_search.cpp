@@ -1,10 +1,11 @@
 #include "pq_table.h"
+#include "reranker.h"
 #include "utils.h"
 
 
 int main(int argc, char *argv []){
     int top_k;
-    assert(argc == 1 || argc == 2);
+    assert(1 <= argc && argc <= 3);
     if(argc == 1){
         top_k = 1;
     }else{
@@ -12,6 +13,9 @@ int main(int argc, char *argv []){
     }
     std::cout << "top_k: " << top_k << std::endl;
 
+    // If shortlist_size is given (e.g., 100), the results are re-ranked by the exact distances
+    int shortlist_size = (argc == 3) ? atoi(argv[2]) : -1;
+
 
     // (1) Make sure you've already run "demo_sift1b_train", "demo_sift1b_encode",
     //     "demo_sift1b_build_table". The "pqtable" dir must be in the bin dir.
@@ -34,8 +38,24 @@ int main(int argc, char *argv []){
     }
     std::cout << (pqtable::Elapsed() - t0) / queries.size() * 1000 << " [msec/query] " << std::endl;
 
-    // (5) Write scores
-    pqtable::WriteScores("score.txt", ranked_scores);
+    // (4') Or, search all queries at once using all cores. The results are the same as above
+    t0 = pqtable::Elapsed();
+    ranked_scores = table.QueryBatch(queries, top_k);
+    std::cout << (pqtable::Elapsed() - t0) / queries.size() * 1000 << " [msec/query] (batch search with all cores)" << std::endl;
+
+    // (4'') Optionally, search the top shortlist_size, and re-rank them with the exact distances
+    //       to the base vectors (memory-mapped), which gives a much higher recall
+    if(0 < shortlist_size){
+        pqtable::Reranker reranker("../../data/bigann_base.bvecs", "bvecs");
+        t0 = pqtable::Elapsed();
+        ranked_scores = reranker.RerankBatch(queries, table.QueryBatch(queries, shortlist_size), top_k);
+        std::cout << (pqtable::Elapsed() - t0) / queries.size() * 1000 << " [msec/query] (batch search of "
+                  << shortlist_size << " + re-ranking)" << std::endl;
+    }
+
+    // (5) Write scores. Evaluate them by "pqtable_eval score.bin ../../data/gnd/idx_1000M.ivecs".
+    //     (pqtable::WriteScores writes the same in a text format)
+    pqtable::WriteScoresBinary("score.bin", ranked_scores);
 
 
     return 0;
@@ -0,0 +1,66 @@
+#include "pq_table.h"
+#include "utils.h"
+
+
+int main(){
+    // (1) Make sure you have already downloaded siftsmall data in data/ by scripts/download_siftsmall.sh
+
+    // (2) Read vectors
+    std::vector<std::vector<float> > queries = pqtable::ReadTopN("../../data/siftsmall/siftsmall_query.fvecs", "fvecs");
+    std::vector<std::vector<float> > bases = pqtable::ReadTopN("../../data/siftsmall/siftsmall_base.fvecs", "fvecs");
+    std::vector<std::vector<float> > learns = pqtable::ReadTopN("../../data/siftsmall/siftsmall_learn.fvecs", "fvecs");
+
+
+    // (3) Train a product quantizer, and encode vectors. M=8 (64 bit codes) so that a multi-table is used
+    int M = 8;
+    std::cout << "=== Train a product quantizer ===" << std::endl;
+    pqtable::PQ pq(pqtable::PQ::Learn(learns, M));
+    std::cout << "=== Encode vectors into PQ codes ===" << std::endl;
+    pqtable::UcharVecs codes = pq.Encode(bases);
+
+
+    // (4) Build a multi-PQTable
+    int T = pqtable::PQMultiTable::OptimalT(8 * M, codes.Size());
+    std::cout << "=== Build PQTable (T=" << T << ") ===" << std::endl;
+    pqtable::PQMultiTable tbl(pq.GetCodewords(), codes, T);
+
+
+    // (5) Compare the schedules to probe the tables. The results must be the same
+    const char *names[] = {"round-robin", "nearest-first", "cost-aware"};
+    pqtable::PQMultiTable::Schedule schedules[] = {pqtable::PQMultiTable::SCHEDULE_ROUND_ROBIN,
+                                                   pqtable::PQMultiTable::SCHEDULE_NEAREST_FIRST,
+                                                   pqtable::PQMultiTable::SCHEDULE_COST_AWARE};
+    for(int top_k : {1, 10, 100}){
+        std::cout << "=== top_k: " << top_k << " ===" << std::endl;
+        std::vector<std::vector<std::pair<int, float> > > baseline;
+        for(int s = 0; s < 3; ++s){
+            tbl.SetSchedule(schedules[s]);
+            pqtable::SearchStats stats;
+            std::vector<std::vector<std::pair<int, float> > > scores(queries.size());
+            double t0 = pqtable::Elapsed();
+            for(int q = 0; q < (int) queries.size(); ++q){
+                scores[q] = tbl.Query(queries[q], top_k, pqtable::SearchParams(), NULL, &stats);
+            }
+            double msec = (pqtable::Elapsed() - t0) / queries.size() * 1000;
+
+            // Compare the distances with round-robin. Ids can differ for ties
+            int num_diff = 0;
+            if(s == 0){
+                baseline = scores;
+            }else{
+                for(int q = 0; q < (int) queries.size(); ++q){
+                    for(int k = 0; k < (int) scores[q].size(); ++k){
+                        num_diff += (scores[q][k].second != baseline[q][k].second);
+                    }
+                }
+            }
+
+            std::cout << names[s] << ": " << msec << " [msec/query], "
+                      << (double) stats.num_probes / queries.size() << " [probes/query], "
+                      << (double) stats.num_verified / queries.size() << " [verified/query], "
+                      << num_diff << " different distances" << std::endl;
+        }
+    }
+
+    return 0;
+}
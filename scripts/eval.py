@@ -4,9 +4,12 @@ import argparse
 def read_score(path):
     """
     Given a path of score, reads IDs.
-    :param path: A path of score file
+    :param path: A path of score file, written by WriteScores, or by WriteScoresBinary if it ends with ".bin"
     :return: a (Nq x k) numpy array. Nq is the number of query, k is top_k result/
     """
+    if path.endswith('.bin'):
+        nq, top_k = np.fromfile(path, dtype=np.int32, count=2)
+        return np.fromfile(path, dtype=np.int32, count=nq * top_k, offset=8).reshape(nq, top_k)  # ids. Distances follow
     lines = [line for line in open(path, 'rt')][2:]  # First two lines are header, then skip
     lines = [line.split(',')[0::2][:-1] for line in lines]  # For each line (each query), split id and scores, select ids, then pop the final \n
     lines = [[int(elem) for elem in line] for line in lines]  # Convert to int
@@ -0,0 +1,52 @@
+#include "candidate_counter.h"
+#include <algorithm>
+
+namespace pqtable {
+
+CandidateCounter::CandidateCounter()
+    : m_dense(true), m_epoch(0), m_mask(0), m_numUsed(0)
+{}
+
+void CandidateCounter::Reset(long long N)
+{
+    assert(0 <= N);
+    m_dense = N <= DENSE_LIMIT;
+
+    ++m_epoch;
+    if(m_epoch == (1U << 24)){ // wrap around. Clear everything once
+        std::fill(m_entries.begin(), m_entries.end(), 0U);
+        std::fill(m_slots.begin(), m_slots.end(), Slot{0U, 0U});
+        m_epoch = 1;
+    }
+
+    if(m_dense){
+        if((long long) m_entries.size() < N){ // Only grows. Can be shared by tables with different N
+            m_entries.resize(N, 0U);
+        }
+    }else{
+        if(m_slots.empty()){
+            m_slots.resize(1 << 16, Slot{0U, 0U});
+            m_mask = m_slots.size() - 1;
+        }
+        m_numUsed = 0;
+    }
+}
+
+void CandidateCounter::Grow()
+{
+    std::vector<Slot> old;
+    old.swap(m_slots);
+    m_slots.resize(old.size() * 2, Slot{0U, 0U});
+    m_mask = m_slots.size() - 1;
+    for(const Slot &s : old){
+        if((s.v >> 8) == m_epoch){
+            unsigned long long pos = Hash(s.id) & m_mask;
+            while((m_slots[pos].v >> 8) == m_epoch){
+                pos = (pos + 1) & m_mask;
+            }
+            m_slots[pos] = s;
+        }
+    }
+}
+
+}
@@ -0,0 +1,82 @@
+#ifndef PQTABLE_CANDIDATE_COUNTER_H
+#define PQTABLE_CANDIDATE_COUNTER_H
+
+// Counts how many times each id is found during a multi-table search.
+//
+// Each entry packs (epoch << 8 | count) into a uint, and an entry is regarded as
+// zero if its epoch is not the current one. So Reset() for the next query is just
+// "++epoch" (the whole array is cleared only when the 24-bit epoch wraps around),
+// and Increment() is a single memory access. No allocation happens once the
+// counter has grown to the size of the index.
+//
+// If the number of items is small (<= DENSE_LIMIT), entries are a dense array indexed by id.
+// Otherwise, they are an open-addressing (linear probing) table, which grows with
+// the number of distinct ids found in a query instead of with the number of items.
+//
+// Usage:
+//   CandidateCounter counter;
+//   counter.Reset(N);                 /* for each query */
+//   int c = counter.Increment(id);    /* c == 1 for the first time */
+
+#include <vector>
+#include <cassert>
+
+namespace pqtable {
+
+class CandidateCounter{
+public:
+    CandidateCounter();
+
+    // Start counting for a new query. N is the number of items (ids are in [0, N)).
+    // Counts must be less than 256
+    void Reset(long long N);
+
+    // Increment the count of id, and return the new count
+    int Increment(unsigned int id){
+        if(m_dense){
+            unsigned int v = m_entries[id];
+            v = ((v >> 8) == m_epoch ? v : (m_epoch << 8)) + 1;
+            m_entries[id] = v;
+            return (int) (v & 255);
+        }
+        if(m_mask < 2 * m_numUsed){ // Keep the load factor <= 1/2
+            Grow();
+        }
+        unsigned long long pos = Hash(id) & m_mask;
+        while(true){
+            Slot &slot = m_slots[pos];
+            if((slot.v >> 8) != m_epoch){ // empty
+                slot.id = id;
+                slot.v = (m_epoch << 8) + 1;
+                ++m_numUsed;
+                return 1;
+            }
+            if(slot.id == id){
+                return (int) (++slot.v & 255);
+            }
+            pos = (pos + 1) & m_mask;
+        }
+    }
+
+    static const long long DENSE_LIMIT = 1LL << 24; // 64 MB per counter
+
+private:
+    struct Slot{
+        unsigned int id;
+        unsigned int v;  // epoch << 8 | count
+    };
+
+    static unsigned long long Hash(unsigned int id) {return (unsigned long long) id * 0x9E3779B97F4A7C15ULL >> 32;}
+    void Grow();
+
+    bool m_dense;
+    unsigned int m_epoch;                 // in [1, 2^24)
+    std::vector<unsigned int> m_entries;  // dense. [id]
+    std::vector<Slot> m_slots;            // open addressing. The size is a power of two
+    unsigned long long m_mask;            // m_slots.size() - 1
+    unsigned long long m_numUsed;         // the number of ids in the current epoch
+};
+
+}
+
+#endif // PQTABLE_CANDIDATE_COUNTER_H
@@ -3,6 +3,12 @@
 namespace pqtable {
 
 void CodeToKey::CodeToKey1(int M, const std::vector<uchar> &code, uint *key)
+{
+    assert((int) code.size() == M);
+    CodeToKey1(M, code.data(), key);
+}
+
+void CodeToKey::CodeToKey1(int M, const uchar *code, uint *key)
 {
     if(M == 1){
         *key = Code1ToKey(code[0]);
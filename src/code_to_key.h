@@ -13,6 +13,7 @@ class CodeToKey
 {
 public:
     static void CodeToKey1(int M, const std::vector<uchar> &code, uint *key); // key should be uint key    (single var)
+    static void CodeToKey1(int M, const uchar *code, uint *key); // The same as above. code is M-dim array
     static void CodeToKey2(int M, const std::vector<uchar> &code, uint *key); // key should be uint key[2] (array of uint)
     static void CodeToKey4(int M, const std::vector<uchar> &code, uint *key); // key should be uint key[4] (array of uint)
     static void CodeToKey8(int M, const std::vector<uchar> &code, uint *key); // key should be uint key[8] (array of uint)
@@ -23,6 +24,17 @@ public:
     static uint Code2ToKey(const uchar &v1, const uchar &v2);
     static uint Code4ToKey(const uchar &v1, const uchar &v2, const uchar &v3, const uchar &v4);
 
+    // The same as CodeToKey1, specialized for M (<= 4) at compile time. No branch
+    template<int M>
+    static uint CodeToKeyM(const uchar *code) {
+        static_assert(1 <= M && M <= 4, "M must be 1, 2, 3, or 4");
+        uint key = 0;
+        for(int m = 0; m < M; ++m){
+            key = (key << 8) | code[m];
+        }
+        return key;
+    }
+
 private:
     CodeToKey(); // prohibit default constructing
 
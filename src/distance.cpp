@@ -0,0 +1,448 @@
+#include "distance.h"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PQTABLE_X86
+#include <immintrin.h>
+#endif
+
+namespace pqtable {
+
+namespace {
+
+// ---- scalar ----
+float L2SqrScalar(const float *x, const float *y, int d)
+{
+    float dist = 0;
+    for(int i = 0; i < d; ++i){
+        float diff = x[i] - y[i];
+        dist += diff * diff;
+    }
+    return dist;
+}
+
+void L2SqrTransposedScalar(const float *x, const float *cw, int Ds, int Ks, int stride, float *dists)
+{
+    for(int ks = 0; ks < Ks; ++ks){
+        dists[ks] = 0;
+    }
+    for(int ds = 0; ds < Ds; ++ds){
+        const float *row = cw + (size_t) ds * stride;
+        for(int ks = 0; ks < Ks; ++ks){
+            float diff = x[ds] - row[ks];
+            dists[ks] += diff * diff;
+        }
+    }
+}
+
+void InnerProductsTransposedScalar(const float *const *xs, int n, const float *cw, int Ds, int Ks, int stride, float *ips)
+{
+    for(int i = 0; i < n; ++i){
+        float *out = ips + (size_t) i * Ks;
+        for(int ks = 0; ks < Ks; ++ks){
+            out[ks] = 0;
+        }
+        for(int ds = 0; ds < Ds; ++ds){
+            const float *row = cw + (size_t) ds * stride;
+            float x = xs[i][ds];
+            for(int ks = 0; ks < Ks; ++ks){
+                out[ks] += x * row[ks];
+            }
+        }
+    }
+}
+
+// The number of codes prefetched ahead by AsymDists
+const int AD_PREFETCH_AHEAD = 16;
+
+void AsymDistsScalar(const float *dtable, int M, int Ks, const unsigned char *codes,
+                     const unsigned int *ids, int n, float *dists)
+{
+    for(int i = 0; i < n && i < AD_PREFETCH_AHEAD; ++i){
+        __builtin_prefetch(codes + (size_t) ids[i] * M);
+    }
+    for(int i = 0; i < n; ++i){
+        if(i + AD_PREFETCH_AHEAD < n){
+            __builtin_prefetch(codes + (size_t) ids[i + AD_PREFETCH_AHEAD] * M);
+        }
+        const unsigned char *code = codes + (size_t) ids[i] * M;
+        float dist = 0;
+        for(int m = 0; m < M; ++m){
+            dist += dtable[m * Ks + code[m]];
+        }
+        dists[i] = dist;
+    }
+}
+
+// blocks[(b * M + m) * 32 + j] is the m-th element of the code of the j-th item of the b-th block
+void AsymDistsBlockedScalar(const float *dtable, int M, int Ks, const unsigned char *blocks,
+                            long long num_blocks, float *dists)
+{
+    for(long long b = 0; b < num_blocks; ++b){
+        const unsigned char *block = blocks + b * M * 32;
+        float *out = dists + b * 32;
+        for(int j = 0; j < 32; ++j){
+            out[j] = 0;
+        }
+        for(int m = 0; m < M; ++m){
+            for(int j = 0; j < 32; ++j){
+                out[j] += dtable[m * Ks + block[m * 32 + j]];
+            }
+        }
+    }
+}
+
+// blocks[(b * M2 + m2) * 32 + j] holds the (2 * m2)-th element of the code of the j-th item of the
+// b-th block in the low 4 bits, and the (2 * m2 + 1)-th one in the high 4 bits, where M2 = (M + 1) / 2
+void FastScanBlockedScalar(const unsigned char *luts, int M, const unsigned char *blocks,
+                           long long num_blocks, unsigned short qmax, unsigned short *qsums, unsigned int *masks)
+{
+    int M2 = (M + 1) / 2;
+    for(long long b = 0; b < num_blocks; ++b){
+        const unsigned char *block = blocks + b * M2 * 32;
+        masks[b] = 0;
+        for(int j = 0; j < 32; ++j){
+            unsigned int qsum = 0;
+            for(int m2 = 0; m2 < M2; ++m2){
+                unsigned char c = block[m2 * 32 + j];
+                qsum += luts[(2 * m2) * 16 + (c & 15)] + luts[(2 * m2 + 1) * 16 + (c >> 4)];
+            }
+            qsums[b * 32 + j] = (unsigned short) std::min(qsum, 65535u); // Saturated, like _mm256_adds_epu16
+            if(qsums[b * 32 + j] <= qmax){
+                masks[b] |= 1u << j;
+            }
+        }
+    }
+}
+
+#ifdef PQTABLE_X86
+
+// ---- AVX2 + FMA ----
+__attribute__((target("avx2,fma")))
+float L2SqrAvx2(const float *x, const float *y, int d)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for(; i + 8 <= d; i += 8){
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        acc = _mm256_fmadd_ps(diff, diff, acc);
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    float dist = _mm_cvtss_f32(s);
+    for(; i < d; ++i){
+        float diff = x[i] - y[i];
+        dist += diff * diff;
+    }
+    return dist;
+}
+
+// Each lane is a code, so the sum of each lane is in the same order as the scalar version
+__attribute__((target("avx2,fma")))
+void AsymDistsAvx2(const float *dtable, int M, int Ks, const unsigned char *codes,
+                   const unsigned int *ids, int n, float *dists)
+{
+    for(int i = 0; i < n && i < AD_PREFETCH_AHEAD; ++i){
+        __builtin_prefetch(codes + (size_t) ids[i] * M);
+    }
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        for(int k = i + AD_PREFETCH_AHEAD; k < i + AD_PREFETCH_AHEAD + 8 && k < n; ++k){
+            __builtin_prefetch(codes + (size_t) ids[k] * M);
+        }
+        const unsigned char *c[8];
+        for(int k = 0; k < 8; ++k){
+            c[k] = codes + (size_t) ids[i + k] * M;
+        }
+        __m256 acc = _mm256_setzero_ps();
+        for(int m = 0; m < M; ++m){
+            __m256i ks = _mm256_setr_epi32(c[0][m], c[1][m], c[2][m], c[3][m], c[4][m], c[5][m], c[6][m], c[7][m]);
+            acc = _mm256_add_ps(acc, _mm256_i32gather_ps(dtable + m * Ks, ks, 4));
+        }
+        _mm256_storeu_ps(dists + i, acc);
+    }
+    for(; i < n; ++i){
+        const unsigned char *code = codes + (size_t) ids[i] * M;
+        float dist = 0;
+        for(int m = 0; m < M; ++m){
+            dist += dtable[m * Ks + code[m]];
+        }
+        dists[i] = dist;
+    }
+}
+
+// 32 codes per block as 4 x 8 lanes. The sum of each lane is in the same order as the scalar version
+__attribute__((target("avx2,fma")))
+void AsymDistsBlockedAvx2(const float *dtable, int M, int Ks, const unsigned char *blocks,
+                          long long num_blocks, float *dists)
+{
+    for(long long b = 0; b < num_blocks; ++b){
+        const unsigned char *block = blocks + b * M * 32;
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+        for(int m = 0; m < M; ++m){
+            const float *row = dtable + m * Ks;
+            const unsigned char *c = block + m * 32;
+            a0 = _mm256_add_ps(a0, _mm256_i32gather_ps(row, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) c)), 4));
+            a1 = _mm256_add_ps(a1, _mm256_i32gather_ps(row, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (c + 8))), 4));
+            a2 = _mm256_add_ps(a2, _mm256_i32gather_ps(row, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (c + 16))), 4));
+            a3 = _mm256_add_ps(a3, _mm256_i32gather_ps(row, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (c + 24))), 4));
+        }
+        float *out = dists + b * 32;
+        _mm256_storeu_ps(out, a0);
+        _mm256_storeu_ps(out + 8, a1);
+        _mm256_storeu_ps(out + 16, a2);
+        _mm256_storeu_ps(out + 24, a3);
+    }
+}
+
+// The 16-entry tables are kept in registers, and a shuffle looks up 32 codes at once
+// (A. Andre et al., "Cache locality is not enough: High-Performance Nearest Neighbor Search
+// with Product Quantization Fast Scan", VLDB 2015)
+__attribute__((target("avx2,fma")))
+void FastScanBlockedAvx2(const unsigned char *luts, int M, const unsigned char *blocks,
+                         long long num_blocks, unsigned short qmax, unsigned short *qsums, unsigned int *masks)
+{
+    int M2 = (M + 1) / 2;
+    const __m256i low4 = _mm256_set1_epi8(15);
+    const __m256i qmax16 = _mm256_set1_epi16((short) qmax);
+    for(long long b = 0; b < num_blocks; ++b){
+        const unsigned char *block = blocks + b * M2 * 32;
+        __m256i acc_lo = _mm256_setzero_si256(), acc_hi = _mm256_setzero_si256(); // items [0, 16) and [16, 32)
+        for(int m2 = 0; m2 < M2; ++m2){
+            __m256i c = _mm256_loadu_si256((const __m256i *) (block + m2 * 32));
+            __m256i lut0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (luts + (2 * m2) * 16)));
+            __m256i lut1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (luts + (2 * m2 + 1) * 16)));
+            __m256i r0 = _mm256_shuffle_epi8(lut0, _mm256_and_si256(c, low4));
+            __m256i r1 = _mm256_shuffle_epi8(lut1, _mm256_and_si256(_mm256_srli_epi16(c, 4), low4));
+            acc_lo = _mm256_adds_epu16(acc_lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(r0)));
+            acc_hi = _mm256_adds_epu16(acc_hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(r0, 1)));
+            acc_lo = _mm256_adds_epu16(acc_lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(r1)));
+            acc_hi = _mm256_adds_epu16(acc_hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(r1, 1)));
+        }
+        _mm256_storeu_si256((__m256i *) (qsums + b * 32), acc_lo);
+        _mm256_storeu_si256((__m256i *) (qsums + b * 32 + 16), acc_hi);
+
+        // qsum <= qmax iff min(qsum, qmax) == qsum. The 16-bit results are packed to bytes
+        // (the packing interleaves the 128-bit lanes, which the permutation restores) for a movemask
+        __m256i le_lo = _mm256_cmpeq_epi16(_mm256_min_epu16(acc_lo, qmax16), acc_lo);
+        __m256i le_hi = _mm256_cmpeq_epi16(_mm256_min_epu16(acc_hi, qmax16), acc_hi);
+        __m256i le = _mm256_permute4x64_epi64(_mm256_packs_epi16(le_lo, le_hi), 0xD8);
+        masks[b] = (unsigned int) _mm256_movemask_epi8(le);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void L2SqrTransposedAvx2(const float *x, const float *cw, int Ds, int Ks, int stride, float *dists)
+{
+    int ks = 0;
+    for(; ks + 8 <= Ks; ks += 8){  // 8 codewords at once
+        __m256 acc = _mm256_setzero_ps();
+        for(int ds = 0; ds < Ds; ++ds){
+            __m256 diff = _mm256_sub_ps(_mm256_set1_ps(x[ds]), _mm256_loadu_ps(cw + (size_t) ds * stride + ks));
+            acc = _mm256_fmadd_ps(diff, diff, acc);
+        }
+        _mm256_storeu_ps(dists + ks, acc);
+    }
+    for(; ks < Ks; ++ks){
+        float dist = 0;
+        for(int ds = 0; ds < Ds; ++ds){
+            float diff = x[ds] - cw[(size_t) ds * stride + ks];
+            dist += diff * diff;
+        }
+        dists[ks] = dist;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void InnerProductsTransposedAvx2(const float *const *xs, int n, const float *cw, int Ds, int Ks, int stride, float *ips)
+{
+    int i = 0;
+    for(; i + 4 <= n; i += 4){ // 4 sub-vectors x 8 codewords per tile
+        const float *x0 = xs[i], *x1 = xs[i + 1], *x2 = xs[i + 2], *x3 = xs[i + 3];
+        int ks = 0;
+        for(; ks + 8 <= Ks; ks += 8){
+            __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+            for(int ds = 0; ds < Ds; ++ds){
+                __m256 c = _mm256_loadu_ps(cw + (size_t) ds * stride + ks);
+                a0 = _mm256_fmadd_ps(_mm256_set1_ps(x0[ds]), c, a0);
+                a1 = _mm256_fmadd_ps(_mm256_set1_ps(x1[ds]), c, a1);
+                a2 = _mm256_fmadd_ps(_mm256_set1_ps(x2[ds]), c, a2);
+                a3 = _mm256_fmadd_ps(_mm256_set1_ps(x3[ds]), c, a3);
+            }
+            _mm256_storeu_ps(ips + (size_t) i * Ks + ks, a0);
+            _mm256_storeu_ps(ips + (size_t) (i + 1) * Ks + ks, a1);
+            _mm256_storeu_ps(ips + (size_t) (i + 2) * Ks + ks, a2);
+            _mm256_storeu_ps(ips + (size_t) (i + 3) * Ks + ks, a3);
+        }
+        if(ks < Ks){ // the rest of codewords
+            const float *rest[4] = {x0, x1, x2, x3};
+            for(int r = 0; r < 4; ++r){
+                for(int k = ks; k < Ks; ++k){
+                    float ip = 0;
+                    for(int ds = 0; ds < Ds; ++ds){
+                        ip += rest[r][ds] * cw[(size_t) ds * stride + k];
+                    }
+                    ips[(size_t) (i + r) * Ks + k] = ip;
+                }
+            }
+        }
+    }
+    if(i < n){ // the rest of sub-vectors
+        InnerProductsTransposedScalar(xs + i, n - i, cw, Ds, Ks, stride, ips + (size_t) i * Ks);
+    }
+}
+
+// ---- AVX-512 ----
+__attribute__((target("avx512f")))
+float L2SqrAvx512(const float *x, const float *y, int d)
+{
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for(; i + 16 <= d; i += 16){
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+        acc = _mm512_fmadd_ps(diff, diff, acc);
+    }
+    if(i < d){ // masked tail
+        __mmask16 mask = (__mmask16) ((1u << (d - i)) - 1);
+        __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i));
+        acc = _mm512_fmadd_ps(diff, diff, acc);
+    }
+    // Horizontal sum. (_mm512_reduce_add_ps triggers a false -Wuninitialized on GCC 12)
+    alignas(64) float buf[16];
+    _mm512_store_ps(buf, acc);
+    float dist = 0;
+    for(int k = 0; k < 16; ++k){
+        dist += buf[k];
+    }
+    return dist;
+}
+
+__attribute__((target("avx512f")))
+void L2SqrTransposedAvx512(const float *x, const float *cw, int Ds, int Ks, int stride, float *dists)
+{
+    for(int ks = 0; ks < Ks; ks += 16){  // 16 codewords at once
+        __mmask16 mask = (Ks - ks < 16) ? (__mmask16) ((1u << (Ks - ks)) - 1) : (__mmask16) 0xFFFF;
+        __m512 acc = _mm512_setzero_ps();
+        for(int ds = 0; ds < Ds; ++ds){
+            __m512 diff = _mm512_sub_ps(_mm512_set1_ps(x[ds]),
+                                        _mm512_maskz_loadu_ps(mask, cw + (size_t) ds * stride + ks));
+            acc = _mm512_fmadd_ps(diff, diff, acc);
+        }
+        _mm512_mask_storeu_ps(dists + ks, mask, acc);
+    }
+}
+
+__attribute__((target("avx512f")))
+void InnerProductsTransposedAvx512(const float *const *xs, int n, const float *cw, int Ds, int Ks, int stride, float *ips)
+{
+    for(int i = 0; i < n; i += 4){ // 4 sub-vectors x 16 codewords per tile
+        int nr = (n - i < 4) ? n - i : 4;
+        const float *x0 = xs[i];
+        const float *x1 = xs[i + (1 < nr ? 1 : 0)]; // duplicate the last one if fewer than 4
+        const float *x2 = xs[i + (2 < nr ? 2 : 0)];
+        const float *x3 = xs[i + (3 < nr ? 3 : 0)];
+        for(int ks = 0; ks < Ks; ks += 16){
+            __mmask16 mask = (Ks - ks < 16) ? (__mmask16) ((1u << (Ks - ks)) - 1) : (__mmask16) 0xFFFF;
+            __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+            for(int ds = 0; ds < Ds; ++ds){
+                __m512 c = _mm512_maskz_loadu_ps(mask, cw + (size_t) ds * stride + ks);
+                a0 = _mm512_fmadd_ps(_mm512_set1_ps(x0[ds]), c, a0);
+                a1 = _mm512_fmadd_ps(_mm512_set1_ps(x1[ds]), c, a1);
+                a2 = _mm512_fmadd_ps(_mm512_set1_ps(x2[ds]), c, a2);
+                a3 = _mm512_fmadd_ps(_mm512_set1_ps(x3[ds]), c, a3);
+            }
+            _mm512_mask_storeu_ps(ips + (size_t) i * Ks + ks, mask, a0);
+            if(1 < nr) _mm512_mask_storeu_ps(ips + (size_t) (i + 1) * Ks + ks, mask, a1);
+            if(2 < nr) _mm512_mask_storeu_ps(ips + (size_t) (i + 2) * Ks + ks, mask, a2);
+            if(3 < nr) _mm512_mask_storeu_ps(ips + (size_t) (i + 3) * Ks + ks, mask, a3);
+        }
+    }
+}
+
+#endif // PQTABLE_X86
+
+// The selected kernels. Initialized once (thread-safe since C++11)
+struct Kernels{
+    const char *name;
+    float (*l2sqr)(const float *, const float *, int);
+    void (*l2sqr_transposed)(const float *, const float *, int, int, int, float *);
+    void (*inner_products_transposed)(const float *const *, int, const float *, int, int, int, float *);
+    void (*asym_dists)(const float *, int, int, const unsigned char *, const unsigned int *, int, float *);
+    void (*asym_dists_blocked)(const float *, int, int, const unsigned char *, long long, float *);
+    void (*fast_scan_blocked)(const unsigned char *, int, const unsigned char *, long long, unsigned short,
+                              unsigned short *, unsigned int *);
+
+    Kernels() : name("scalar"), l2sqr(L2SqrScalar), l2sqr_transposed(L2SqrTransposedScalar),
+        inner_products_transposed(InnerProductsTransposedScalar), asym_dists(AsymDistsScalar),
+        asym_dists_blocked(AsymDistsBlockedScalar), fast_scan_blocked(FastScanBlockedScalar) {
+#ifdef PQTABLE_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx512f")){
+            name = "avx512";
+            l2sqr = L2SqrAvx512;
+            l2sqr_transposed = L2SqrTransposedAvx512;
+            inner_products_transposed = InnerProductsTransposedAvx512;
+            asym_dists = AsymDistsAvx2; // 16-lane gathers are not faster
+            asym_dists_blocked = AsymDistsBlockedAvx2;
+            fast_scan_blocked = FastScanBlockedAvx2;
+        }else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+            name = "avx2";
+            l2sqr = L2SqrAvx2;
+            l2sqr_transposed = L2SqrTransposedAvx2;
+            inner_products_transposed = InnerProductsTransposedAvx2;
+            asym_dists = AsymDistsAvx2;
+            asym_dists_blocked = AsymDistsBlockedAvx2;
+            fast_scan_blocked = FastScanBlockedAvx2;
+        }
+#endif
+    }
+};
+
+const Kernels &GetKernels()
+{
+    static const Kernels kernels;
+    return kernels;
+}
+
+}
+
+const char *SimdLevel()
+{
+    return GetKernels().name;
+}
+
+float L2Sqr(const float *x, const float *y, int d)
+{
+    return GetKernels().l2sqr(x, y, d);
+}
+
+void L2SqrTransposed(const float *x, const float *cw, int Ds, int Ks, int stride, float *dists)
+{
+    GetKernels().l2sqr_transposed(x, cw, Ds, Ks, stride, dists);
+}
+
+void InnerProductsTransposed(const float *const *xs, int n, const float *cw, int Ds, int Ks, int stride, float *ips)
+{
+    GetKernels().inner_products_transposed(xs, n, cw, Ds, Ks, stride, ips);
+}
+
+void AsymDists(const float *dtable, int M, int Ks, const unsigned char *codes,
+               const unsigned int *ids, int n, float *dists)
+{
+    GetKernels().asym_dists(dtable, M, Ks, codes, ids, n, dists);
+}
+
+void AsymDistsBlocked(const float *dtable, int M, int Ks, const unsigned char *blocks,
+                      long long num_blocks, float *dists)
+{
+    GetKernels().asym_dists_blocked(dtable, M, Ks, blocks, num_blocks, dists);
+}
+
+void FastScanBlocked(const unsigned char *luts, int M, const unsigned char *blocks,
+                     long long num_blocks, unsigned short qmax, unsigned short *qsums, unsigned int *masks)
+{
+    GetKernels().fast_scan_blocked(luts, M, blocks, num_blocks, qmax, qsums, masks);
+}
+
+}
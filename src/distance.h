@@ -0,0 +1,93 @@
+#ifndef PQTABLE_DISTANCE_H
+#define PQTABLE_DISTANCE_H
+
+// Squared L2 distance kernels.
+//
+// AVX-512, AVX2 (+FMA), and scalar versions are compiled, and the fastest one that
+// the running CPU supports is selected once at runtime, so a single binary
+// runs on any x86-64 machine (and falls back to scalar on other architectures).
+//
+// Usage:
+//   float d = pqtable::L2Sqr(x, y, D);   // ||x - y||^2
+//
+//   /* Distances from a sub-vector to all codewords of a subspace, where the codewords */
+//   /* are stored transposed, i.e., cw[ds * stride + ks] is the ds-th element of the */
+//   /* ks-th codeword. This is the inner loop of PQ::DTable and PQ::Encode. */
+//   pqtable::L2SqrTransposed(x, cw, Ds, Ks, stride, dists);  // dists[ks] = ||x - cw[:, ks]||^2
+//
+//   /* Inner products between n sub-vectors (xs[i] points to the i-th one) and all codewords */
+//   /* in the same transposed layout. This is a small matrix multiplication (n x Ds) * (Ds x Ks), */
+//   /* blocked so that a loaded codeword row is reused for 4 sub-vectors. Used by PQ's batch encoder. */
+//   pqtable::InnerProductsTransposed(xs, n, cw, Ds, Ks, stride, ips);  // ips[i * Ks + ks] = <xs[i], cw[:, ks]>
+//
+//   /* Asymmetric distances of n PQ-codes picked by ids from codes (M bytes each), with a flat */
+//   /* distance table (dtable[m * Ks + ks]). Codes are prefetched a few ahead, so the cache misses */
+//   /* of random ids overlap, and 8 codes are looked up at once by gathers. Used to verify the */
+//   /* candidates of a bucket. The results are bitwise the same as PQ::AD */
+//   pqtable::AsymDists(dtable, M, Ks, codes, ids, n, dists);  // dists[i] = AD(dtable, codes + ids[i] * M)
+//
+//   /* Exhaustive scans over codes in a blocked layout, where the codes of 32 items are stored */
+//   /* transposed so that a load reads the m-th elements of 32 codes. Used by PQFlatTable. */
+//   /* (1) Any Ks: blocks[(b * M + m) * 32 + j] is the m-th element of the code of item b * 32 + j. */
+//   /*     The results are bitwise the same as PQ::AD */
+//   pqtable::AsymDistsBlocked(dtable, M, Ks, blocks, num_blocks, dists);  // dists[b * 32 + j]
+//   /* (2) Ks <= 16 (4-bit codes): two elements are packed into a byte, i.e., */
+//   /*     blocks[(b * ((M + 1) / 2) + m2) * 32 + j] is (elem 2 * m2) | (elem 2 * m2 + 1) << 4, and the */
+//   /*     distance table is quantized to 8 bits (luts[m * 16 + ks], 16 entries even if Ks < 16, and */
+//   /*     ((M + 1) / 2) * 32 entries in total. The padded table for an odd M must be zeros). Then */
+//   /*     a table of a subspace fits in a register, and 32 codes are looked up by a shuffle. */
+//   /*     The sums saturate at 65535. The j-th bit of masks[b] tells whether qsums[b * 32 + j] <= qmax */
+//   pqtable::FastScanBlocked(luts, M, blocks, num_blocks, qmax, qsums, masks);  // qsums[b * 32 + j] = sum_m luts[m * 16 + elem m]
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace pqtable {
+
+// The name of the selected kernels: "avx512", "avx2", or "scalar"
+const char *SimdLevel();
+
+float L2Sqr(const float *x, const float *y, int d);
+
+void L2SqrTransposed(const float *x, const float *cw, int Ds, int Ks, int stride, float *dists);
+
+void InnerProductsTransposed(const float *const *xs, int n, const float *cw, int Ds, int Ks, int stride, float *ips);
+
+void AsymDists(const float *dtable, int M, int Ks, const unsigned char *codes,
+               const unsigned int *ids, int n, float *dists);
+
+void AsymDistsBlocked(const float *dtable, int M, int Ks, const unsigned char *blocks,
+                      long long num_blocks, float *dists);
+
+void FastScanBlocked(const unsigned char *luts, int M, const unsigned char *blocks,
+                     long long num_blocks, unsigned short qmax, unsigned short *qsums, unsigned int *masks);
+
+
+// Allocator for std::vector, which aligns the array to "Align" bytes (e.g., a cache line)
+template <typename T, size_t Align = 64>
+class AlignedAllocator{
+public:
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Align> &) {}
+
+    T *allocate(size_t n) {
+        void *p = NULL;
+        if(posix_memalign(&p, Align, n * sizeof(T) + (n == 0)) != 0){
+            throw std::bad_alloc();
+        }
+        return (T *) p;
+    }
+    void deallocate(T *p, size_t) { free(p); }
+};
+template <typename T, typename U, size_t A>
+bool operator ==(const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &) {return true;}
+template <typename T, typename U, size_t A>
+bool operator !=(const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &) {return false;}
+
+}
+
+#endif // PQTABLE_DISTANCE_H
@@ -0,0 +1,140 @@
+#include "evaluation.h"
+#include "distance.h"
+#include "top_k.h"
+#include <omp.h>
+#include <climits>
+
+namespace pqtable {
+
+// Brute force. get_base(n, out) writes the n-th base vector (D floats) to out.
+// The base vectors are converted to float a chunk at a time (in parallel), and the chunk, small enough
+// to stay in the cache, is compared with all queries (in parallel). So each base vector is read once
+template<class GetBase>
+static std::vector<std::vector<std::pair<int, float> > > ExactSearchImpl(long long N, int D, GetBase get_base,
+                                                                         const std::vector<std::vector<float> > &queries,
+                                                                         int top_k, int num_threads)
+{
+    assert(0 < top_k);
+    if(INT_MAX < N){ // ids are int, as in the scores and the .ivecs files
+        std::cerr << "Error: N must be <= INT_MAX in ExactSearch. N: " << N << std::endl;
+        exit(1);
+    }
+    if(num_threads == -1){
+        num_threads = omp_get_max_threads();
+    }
+    int Q = (int) queries.size();
+    for(const auto &query : queries){
+        assert((int) query.size() == D);
+    }
+
+    const long long CHUNK = std::max(1LL, (2LL << 20) / ((long long) D * (long long) sizeof(float))); // 2 MB of base vectors
+    std::vector<float> chunk(CHUNK * D);
+    std::vector<TopK> topks(Q, TopK(top_k));
+    for(long long begin = 0; begin < N; begin += CHUNK){
+        long long n = std::min(CHUNK, N - begin);
+        #pragma omp parallel for num_threads(num_threads)
+        for(long long i = 0; i < n; ++i){
+            get_base(begin + i, chunk.data() + i * D);
+        }
+        #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+        for(int q = 0; q < Q; ++q){
+            TopK &topk = topks[q];
+            float threshold = topk.Threshold();
+            for(long long i = 0; i < n; ++i){
+                float dist = L2Sqr(queries[q].data(), chunk.data() + i * D, D);
+                if(dist < threshold){ // An earlier (smaller) id wins a tie
+                    topk.Push((int) (begin + i), dist);
+                    threshold = topk.Threshold();
+                }
+            }
+        }
+    }
+
+    std::vector<std::vector<std::pair<int, float> > > results(Q);
+    for(int q = 0; q < Q; ++q){
+        topks[q].Sorted(&results[q]);
+    }
+    return results;
+}
+
+std::vector<std::vector<std::pair<int, float> > > ExactSearch(const MappedVecs &bases,
+                                                              const std::vector<std::vector<float> > &queries,
+                                                              int top_k, int num_threads)
+{
+    return ExactSearchImpl(bases.Size(), bases.Dim(), [&bases](long long n, float *out){bases.GetFloat(n, out);},
+                           queries, top_k, num_threads);
+}
+
+std::vector<std::vector<std::pair<int, float> > > ExactSearch(const std::vector<std::vector<float> > &bases,
+                                                              const std::vector<std::vector<float> > &queries,
+                                                              int top_k, int num_threads)
+{
+    assert(!bases.empty());
+    int D = (int) bases[0].size();
+    return ExactSearchImpl((long long) bases.size(), D,
+                           [&bases, D](long long n, float *out){std::copy(bases[n].begin(), bases[n].begin() + D, out);},
+                           queries, top_k, num_threads);
+}
+
+void WriteGroundTruth(std::string ivecs_path, const std::vector<std::vector<std::pair<int, float> > > &gt,
+                      std::string fvecs_path)
+{
+    std::ofstream ofs(ivecs_path, std::ios::binary);
+    if(!ofs.is_open()){
+        std::cerr << "Error: cannot open " << ivecs_path << " in WriteGroundTruth" << std::endl;
+        exit(1);
+    }
+    std::ofstream ofs_dist;
+    if(!fvecs_path.empty()){
+        ofs_dist.open(fvecs_path, std::ios::binary);
+        if(!ofs_dist.is_open()){
+            std::cerr << "Error: cannot open " << fvecs_path << " in WriteGroundTruth" << std::endl;
+            exit(1);
+        }
+    }
+
+    // Each record is (1) D (int) and (2) D elements
+    for(const auto &row : gt){
+        assert(!row.empty() && row.size() == gt[0].size()); // .ivecs needs the same dim for all
+        int D = (int) row.size();
+        ofs.write((const char *) &D, sizeof(int));
+        for(const auto &score : row){
+            ofs.write((const char *) &score.first, sizeof(int));
+        }
+        if(ofs_dist.is_open()){
+            ofs_dist.write((const char *) &D, sizeof(int));
+            for(const auto &score : row){
+                ofs_dist.write((const char *) &score.second, sizeof(float));
+            }
+        }
+    }
+}
+
+std::vector<int> ReadNearestIds(std::string ivecs_path)
+{
+    MappedVecs gt(ivecs_path, "ivecs");
+    std::vector<int> nearest_ids(gt.Size());
+    for(long long q = 0; q < gt.Size(); ++q){
+        nearest_ids[q] = gt.Ptr<int>(q)[0];
+    }
+    return nearest_ids;
+}
+
+double RecallAtR(const std::vector<std::vector<std::pair<int, float> > > &scores,
+                 const std::vector<int> &nearest_ids, int R)
+{
+    assert(!scores.empty());
+    assert(scores.size() <= nearest_ids.size()); // The ground truth can have more queries
+    int num_found = 0;
+    for(size_t q = 0; q < scores.size(); ++q){
+        for(int r = 0; r < R && r < (int) scores[q].size(); ++r){
+            if(scores[q][r].first == nearest_ids[q]){
+                ++num_found;
+                break;
+            }
+        }
+    }
+    return (double) num_found / scores.size();
+}
+
+}
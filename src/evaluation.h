@@ -0,0 +1,48 @@
+#ifndef PQTABLE_EVALUATION_H
+#define PQTABLE_EVALUATION_H
+
+// Ground truth and recall.
+//
+// ExactSearch() finds the exact k nearest base vectors (squared L2) of each query by brute force.
+// The base vectors are read once, a chunk at a time, and all queries are compared with each chunk
+// in parallel by the SIMD L2Sqr, so memory-mapped base files larger than the memory work too.
+//
+// Usage:
+//   pqtable::MappedVecs bases("bigann_base.bvecs", "bvecs");
+//   std::vector<std::vector<float> > queries = pqtable::ReadTopN("bigann_query.bvecs", "bvecs");
+//
+//   /* gt[q][k] = (id, distance) of the k-th nearest base vector of the q-th query */
+//   std::vector<std::vector<std::pair<int, float> > > gt = pqtable::ExactSearch(bases, queries, 100);
+//   pqtable::WriteGroundTruth("gt.ivecs", gt);   /* The ids, in the same format as data/gnd/idx_*.ivecs */
+//
+//   /* Recall@R: the ratio of queries whose nearest id is in the top-R results (as scripts/eval.py) */
+//   std::vector<int> nearest_ids = pqtable::ReadNearestIds("gt.ivecs");
+//   double recall = pqtable::RecallAtR(scores, nearest_ids, 10);
+
+#include "utils.h"
+
+namespace pqtable {
+
+// If num_threads == -1, all cores are used. Of the ties at the top_k-th distance, the smaller ids are kept.
+// The ids are int (as in .ivecs), so the number of base vectors must be <= INT_MAX
+std::vector<std::vector<std::pair<int, float> > > ExactSearch(const MappedVecs &bases,
+                                                              const std::vector<std::vector<float> > &queries,
+                                                              int top_k, int num_threads = -1);
+std::vector<std::vector<std::pair<int, float> > > ExactSearch(const std::vector<std::vector<float> > &bases,
+                                                              const std::vector<std::vector<float> > &queries,
+                                                              int top_k, int num_threads = -1);
+
+// Write the ids as .ivecs (a row per query). The distances are also written as .fvecs if fvecs_path is given
+void WriteGroundTruth(std::string ivecs_path, const std::vector<std::vector<std::pair<int, float> > > &gt,
+                      std::string fvecs_path = "");
+
+// The first id of each row of a ground truth .ivecs file
+std::vector<int> ReadNearestIds(std::string ivecs_path);
+
+// scores[q] must have at least R results unless a search returned less
+double RecallAtR(const std::vector<std::vector<std::pair<int, float> > > &scores,
+                 const std::vector<int> &nearest_ids, int R);
+
+}
+
+#endif // PQTABLE_EVALUATION_H
@@ -0,0 +1,55 @@
+#include "mapped_file.h"
+#include <iostream>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace pqtable {
+
+MappedFile::MappedFile(const std::string &path, Warmup warmup)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd == -1){
+        std::cerr << "Error: cannot open " << path << " in MappedFile" << std::endl;
+        exit(1);
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size == 0){
+        std::cerr << "Error: cannot stat (or empty) " << path << " in MappedFile" << std::endl;
+        exit(1);
+    }
+    m_size = (size_t) st.st_size;
+
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if(warmup == WARMUP_POPULATE){
+        flags |= MAP_POPULATE;
+    }
+#endif
+    void *p = mmap(NULL, m_size, PROT_READ, flags, fd, 0);
+    close(fd); // The mapping remains after the fd is closed
+    if(p == MAP_FAILED){
+        std::cerr << "Error: mmap failed for " << path << " in MappedFile" << std::endl;
+        exit(1);
+    }
+    if(warmup == WARMUP_WILLNEED){
+        madvise(p, m_size, MADV_WILLNEED);
+    }
+    m_data = (const char *) p;
+}
+
+void MappedFile::WillNeed(size_t offset, size_t length) const
+{
+    static const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t begin = offset / page_size * page_size; // madvise needs a page-aligned address
+    madvise((void *) (m_data + begin), offset + length - begin, MADV_WILLNEED);
+}
+
+MappedFile::~MappedFile()
+{
+    munmap((void *) m_data, m_size);
+}
+
+}
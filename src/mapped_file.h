@@ -0,0 +1,48 @@
+#ifndef PQTABLE_MAPPED_FILE_H
+#define PQTABLE_MAPPED_FILE_H
+
+// Read-only memory-mapped file (POSIX mmap).
+// The pages are shared with the page cache, so several processes that map the same
+// file share a single copy in memory, and opening a file costs nothing until its
+// pages are touched.
+//
+// Usage:
+//   std::shared_ptr<MappedFile> file(new MappedFile("table.bin", MappedFile::WARMUP_POPULATE));
+//   const char *p = file->Data();   /* valid while file is alive */
+//
+// Warm-up options:
+//   WARMUP_NONE     : pages are read lazily by page faults
+//   WARMUP_WILLNEED : madvise(MADV_WILLNEED). The kernel starts reading asynchronously
+//   WARMUP_POPULATE : MAP_POPULATE. All pages are read before the constructor returns
+
+#include <string>
+#include <cstddef>
+
+namespace pqtable {
+
+class MappedFile{
+public:
+    enum Warmup {WARMUP_NONE, WARMUP_WILLNEED, WARMUP_POPULATE};
+
+    MappedFile(const std::string &path, Warmup warmup = WARMUP_NONE);
+    ~MappedFile();
+
+    const char *Data() const {return m_data;}
+    size_t Size() const {return m_size;}
+
+    // Ask the kernel to read the pages of [offset, offset + length) asynchronously
+    // (madvise(MADV_WILLNEED)), so that page faults of random accesses overlap
+    void WillNeed(size_t offset, size_t length) const;
+
+private:
+    MappedFile();  // prohibit default construct
+    MappedFile(const MappedFile &);  // copy is prohibited
+    const MappedFile &operator =(const MappedFile &);
+
+    const char *m_data;
+    size_t m_size;
+};
+
+}
+
+#endif // PQTABLE_MAPPED_FILE_H
@@ -3,7 +3,7 @@
 
 namespace pqtable {
 
-UcharVecs::UcharVecs(const std::vector<std::vector<uchar> > &vec)
+UcharVecs::UcharVecs(const std::vector<std::vector<uchar> > &vec) : m_mappedData(NULL)
 {
     assert(!vec.empty());
     Resize((int) vec.size(), (int) vec[0].size());
@@ -14,6 +14,11 @@ UcharVecs::UcharVecs(const std::vector<std::vector<uchar> > &vec)
 
 void UcharVecs::Resize(int N, int D)
 {
+    if(m_mapped){ // Copy-on-resize. The mapped values are copied into memory
+        m_data.assign(m_mappedData, m_mappedData + (unsigned long long) m_N * m_D);
+        m_mapped.reset();
+        m_mappedData = NULL;
+    }
     m_N = N;
     m_D = D;
     //m_data.clear(); // values are remained
@@ -22,20 +27,21 @@ void UcharVecs::Resize(int N, int D)
 
 const uchar &UcharVecs::GetVal(int n, int d) const {
     //assert(0 <= n && n < m_N && 0 <= d && d < m_D);
-    return m_data[ (unsigned long long) n * m_D + d];
+    return RawDataPtr()[ (unsigned long long) n * m_D + d];
 }
 
 
 
 std::vector<uchar> UcharVecs::GetVec(int n) const {
     assert(0 <= n && n < m_N);
-    return std::vector<uchar>(m_data.begin() + (unsigned long long) n * m_D,
-                              m_data.begin() + (unsigned long long) (n + 1) * m_D);
+    return std::vector<uchar>(RawDataPtr() + (unsigned long long) n * m_D,
+                              RawDataPtr() + (unsigned long long) (n + 1) * m_D);
 }
 
 
 void UcharVecs::SetVal(int n, int d, uchar val){
     assert(0 <= n && n < m_N && 0 <= d && d < m_D);
+    assert(!m_mapped); // Mapped codes are read-only
     m_data[ (unsigned long long) n * m_D + d] = val;
 }
 
@@ -61,10 +67,7 @@ void UcharVecs::Write(std::string path, const UcharVecs &vecs)
     int D = vecs.Dim();
     ofs.write( (char *) &N, sizeof(int));
     ofs.write( (char *) &D, sizeof(int));
-    for(int n = 0; n < N; ++n){
-        std::vector<uchar> vec = vecs.GetVec(n);
-        ofs.write( (char *) vec.data(), sizeof(uchar) * D);
-    }
+    ofs.write( (char *) vecs.RawDataPtr(), sizeof(uchar) * (unsigned long long) N * D);
 
 }
 
@@ -87,13 +90,12 @@ void UcharVecs::Read(std::string path, UcharVecs *vecs, int top_n)
     }
     assert(0 < top_n && top_n <= N);
 
+    // Read all codes at once
+    vecs->m_mapped.reset();
+    vecs->m_mappedData = NULL;
     vecs->Resize(top_n, D);
-
-    for(int n = 0; n < top_n; ++n){
-        std::vector<uchar> buf(D);
-        ifs.read( (char *) buf.data(), sizeof(uchar) * D);
-        vecs->SetVec(n, buf);
-    }
+    ifs.read( (char *) vecs->m_data.data(), sizeof(uchar) * (unsigned long long) top_n * D);
+    assert(ifs);
 }
 
 UcharVecs UcharVecs::Read(std::string path, int top_n)
@@ -103,11 +105,62 @@ UcharVecs UcharVecs::Read(std::string path, int top_n)
     return codes;
 }
 
+void UcharVecs::Map(std::string path, UcharVecs *vecs, MappedFile::Warmup warmup)
+{
+    assert(vecs != NULL);
+    std::shared_ptr<MappedFile> file(new MappedFile(path, warmup));
+
+    // (1) N, (2) D, and (3) data. The data is used in place
+    assert(2 * sizeof(int) <= file->Size());
+    int N, D;
+    memcpy(&N, file->Data(), sizeof(int));
+    memcpy(&D, file->Data() + sizeof(int), sizeof(int));
+    if(2 * sizeof(int) + (unsigned long long) N * D != file->Size()){
+        std::cerr << "Error: broken file: " << path << " in UcharVecs::Map" << std::endl;
+        assert(0);
+    }
+
+    vecs->m_N = N;
+    vecs->m_D = D;
+    vecs->m_data.clear();
+    vecs->m_data.shrink_to_fit();
+    vecs->m_mapped = file;
+    vecs->m_mappedData = (const uchar *) (file->Data() + 2 * sizeof(int));
+}
+
+UcharVecs UcharVecs::Map(std::string path, MappedFile::Warmup warmup)
+{
+    UcharVecs codes;
+    Map(path, &codes, warmup);
+    return codes;
+}
+
 PQ::PQ(const std::vector<PQ::Array> &codewords){
     m_M = (int) codewords.size();
     m_Ks = (int) codewords[0].size();
     m_Ds = (int) codewords[0][0].size();
     m_codewords = codewords;
+
+    m_stride = (m_Ks + 15) / 16 * 16;
+    m_codewordsT.assign((size_t) m_M * m_Ds * m_stride, 0.0f);
+    for(int m = 0; m < m_M; ++m){
+        for(int ks = 0; ks < m_Ks; ++ks){
+            for(int ds = 0; ds < m_Ds; ++ds){
+                m_codewordsT[((size_t) m * m_Ds + ds) * m_stride + ks] = m_codewords[m][ks][ds];
+            }
+        }
+    }
+
+    m_codewordNorms.resize(m_M * m_Ks);
+    for(int m = 0; m < m_M; ++m){
+        for(int ks = 0; ks < m_Ks; ++ks){
+            float norm = 0;
+            for(int ds = 0; ds < m_Ds; ++ds){
+                norm += m_codewords[m][ks][ds] * m_codewords[m][ks][ds];
+            }
+            m_codewordNorms[m * m_Ks + ks] = norm;
+        }
+    }
 }
 
 std::vector<PQ::Array> PQ::Learn(const std::vector<std::vector<float> > &vecs, int M, int Ks){
@@ -151,24 +204,13 @@ std::vector<uchar> PQ::Encode(const std::vector<float> &vec) const
     assert((int) vec.size() == m_Ds * m_M);
 
     std::vector<uchar> code(m_M);
+    std::vector<float> dists(m_Ks);
 
     for(int m = 0; m < m_M; ++m){
-        float min_dist = FLT_MAX;
-        int min_ks = -1;
-
-        // find the nearest codeword
-        for(int ks = 0; ks < m_Ks; ++ks){
-            float dist = 0;
-            for(int ds = 0; ds < m_Ds; ++ds){
-                float diff = vec[m * m_Ds + ds] - m_codewords[m][ks][ds];
-                dist += diff * diff;
-            }
-            if(dist < min_dist){
-                min_dist = dist;
-                min_ks = ks;
-            }
-        }
-        assert(min_ks != -1);
+        // Compute distances to all codewords by SIMD, then find the nearest one
+        L2SqrTransposed(vec.data() + m * m_Ds, &m_codewordsT[(size_t) m * m_Ds * m_stride],
+                        m_Ds, m_Ks, m_stride, dists.data());
+        int min_ks = (int) (std::min_element(dists.begin(), dists.end()) - dists.begin());
         code[m] = (uchar) min_ks;
     }
     return code;
@@ -178,12 +220,66 @@ std::vector<uchar> PQ::Encode(const std::vector<float> &vec) const
 UcharVecs PQ::Encode(const std::vector<std::vector<float> > &vecs) const
 {
     UcharVecs codes((int) vecs.size(), m_M);
-    for(int n = 0; n < (int) vecs.size(); ++n){
-        codes.SetVec(n, Encode(vecs[n]));
-    }
+    Encode(vecs, &codes, 0);
     return codes;
 }
 
+void PQ::Encode(const std::vector<std::vector<float> > &vecs, UcharVecs *codes, int offset) const
+{
+    assert(codes != NULL);
+    assert(codes->Dim() == m_M);
+    assert(0 <= offset && offset + (int) vecs.size() <= codes->Size());
+    if(vecs.empty()){
+        return;
+    }
+    std::vector<const float *> ptrs(vecs.size());
+    for(size_t n = 0; n < vecs.size(); ++n){
+        assert((int) vecs[n].size() == m_Ds * m_M);
+        ptrs[n] = vecs[n].data();
+    }
+    Encode(ptrs.data(), (long long) vecs.size(), codes->MutableRawDataPtr() + (unsigned long long) offset * m_M);
+}
+
+void PQ::Encode(const float *const *vecs, long long n, uchar *codes) const
+{
+    // #vectors in a block. ips (kBlock * Ks floats) stays in L2
+    const int kBlock = 64;
+
+    #pragma omp parallel
+    {
+        std::vector<float> ips(kBlock * m_Ks);   // ips[i * Ks + ks] = <x_i, c_ks> for the current subspace
+        std::vector<const float *> subs(kBlock); // sub-vectors of the block
+
+        #pragma omp for schedule(dynamic)
+        for(long long begin = 0; begin < n; begin += kBlock){
+            int block = (int) std::min((long long) kBlock, n - begin);
+            for(int m = 0; m < m_M; ++m){
+                for(int i = 0; i < block; ++i){
+                    subs[i] = vecs[begin + i] + m * m_Ds;
+                }
+                InnerProductsTransposed(subs.data(), block, &m_codewordsT[(size_t) m * m_Ds * m_stride],
+                                        m_Ds, m_Ks, m_stride, ips.data());
+
+                // argmin_ks ||c_ks||^2 - 2<x, c_ks>.  (||x||^2 is the same for all ks)
+                const float *norms = &m_codewordNorms[m * m_Ks];
+                for(int i = 0; i < block; ++i){
+                    const float *ip = &ips[(size_t) i * m_Ks];
+                    float min_dist = FLT_MAX;
+                    int min_ks = 0;
+                    for(int ks = 0; ks < m_Ks; ++ks){
+                        float dist = norms[ks] - 2 * ip[ks];
+                        if(dist < min_dist){
+                            min_dist = dist;
+                            min_ks = ks;
+                        }
+                    }
+                    codes[(unsigned long long) (begin + i) * m_M + m] = (uchar) min_ks;
+                }
+            }
+        }
+    }
+}
+
 std::vector<float> PQ::Decode(const std::vector<uchar> &code) const
 {
     assert((int) code.size() == m_M);
@@ -212,22 +308,25 @@ PQ::Array PQ::DTable(const std::vector<float> &query) const
 {
     assert((int) query.size() == m_Ds * m_M);
 
-    Array dtable(m_M, std::vector<float>(m_Ks)); // m_M * m_Ks
+    std::vector<float> flat((size_t) m_M * m_Ks);
+    DTable(query.data(), flat.data());
 
+    Array dtable(m_M); // m_M * m_Ks
     for(int m = 0; m < m_M; ++m){
-        for(int ks = 0; ks < m_Ks; ++ks){
-            float dist = 0;
-            // squared L2 dist
-            for(int ds = 0; ds < m_Ds; ++ds){
-                float diff = query[m * m_Ds + ds] - m_codewords[m][ks][ds];
-                dist += diff * diff;
-            }
-            dtable[m][ks] = dist;
-        }
+        dtable[m].assign(flat.begin() + m * m_Ks, flat.begin() + (m + 1) * m_Ks);
     }
     return dtable;
 }
 
+void PQ::DTable(const float *query, float *dtable) const
+{
+    for(int m = 0; m < m_M; ++m){
+        // squared L2 dist to all codewords in the m-th subspace
+        L2SqrTransposed(query + m * m_Ds, &m_codewordsT[(size_t) m * m_Ds * m_stride],
+                        m_Ds, m_Ks, m_stride, dtable + m * m_Ks);
+    }
+}
+
 float PQ::AD(const PQ::Array &dtable, const std::vector<uchar> &code) const
 {
     //assert( (int) code.size() == m_M);
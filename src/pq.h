@@ -7,6 +7,9 @@
 
 #include <opencv2/opencv.hpp>
 #include <fstream> // for IO
+#include <memory>
+#include "mapped_file.h"
+#include "distance.h"
 
 namespace pqtable {
 
@@ -29,13 +32,16 @@ namespace pqtable {
 // IO interfaces are:
 //     UcharVecs::Write("code.bin", code);  // write
 //     UcharVecs code_read = UcharVecs::Read("code.bin"); // read
+//     UcharVecs code_mapped = UcharVecs::Map("code.bin"); // memory-map. No copy
 // The size of "code.bin" is the ideal size + 8 bytes (we record N and D),
 // e.g., if N=10^9 and D=4, then code.bin will be 4,000,000,008 bytes.
+// A memory-mapped UcharVecs is read-only. Resize() copies the mapped codes into memory,
+// after which the codes can be modified.
 
 class UcharVecs{
 public:
-    UcharVecs() : m_N(0), m_D(0) {}   // Space is not allocated. You need to call Resize first
-    UcharVecs(int N, int D) { Resize(N, D); }  // Space is allocated
+    UcharVecs() : m_N(0), m_D(0), m_mappedData(NULL) {}   // Space is not allocated. You need to call Resize first
+    UcharVecs(int N, int D) : m_mappedData(NULL) { Resize(N, D); }  // Space is allocated
     UcharVecs(const std::vector<std::vector<uchar> > &vec);  // vec<vec<uchar>> -> UcharVecs
 
     void Resize(int N, int D); // After resized, the old values are remained
@@ -52,9 +58,14 @@ public:
     static void Write(std::string path, const UcharVecs &vecs);
     static void Read(std::string path, UcharVecs *vecs, int top_n = -1); // Read top_n codes. if top_n==-1, read all
     static UcharVecs Read(std::string path, int top_n = -1); // wrapper.
+    static void Map(std::string path, UcharVecs *vecs,
+                    MappedFile::Warmup warmup = MappedFile::WARMUP_NONE); // Zero-copy read by mmap
+    static UcharVecs Map(std::string path, MappedFile::Warmup warmup = MappedFile::WARMUP_NONE); // wrapper.
 
     // Be careful
-    const uchar *RawDataPtr() const {return m_data.data();}
+    const uchar *RawDataPtr() const {return m_mapped ? m_mappedData : m_data.data();}
+    uchar *MutableRawDataPtr() {assert(!m_mapped); return m_data.data();} // Not available if mapped
+    bool IsMapped() const {return (bool) m_mapped;}
 
     int Size() const {return m_N;}
     int Dim() const {return m_D;}
@@ -64,6 +75,9 @@ private:
     int m_D;
     std::vector<uchar> m_data; // a long array
 
+    // If mapped, m_data is empty and the codes are read from the mapped file
+    std::shared_ptr<MappedFile> m_mapped;
+    const uchar *m_mappedData;
 };
 
 
@@ -112,18 +126,34 @@ public:
     std::vector<uchar> Encode(const std::vector<float> &vec) const;
     UcharVecs Encode(const std::vector<std::vector<float> > &vecs) const;  // Encode several vectors at once
 
+    // Batch encoder. Encode n vectors (vecs[i] is a D-dim vector) into codes (n * M bytes).
+    // The squared distance is expanded as ||x||^2 - 2<x, c> + ||c||^2, so that the work becomes
+    // cache-blocked matrix multiplications. Blocks of vectors are encoded in parallel.
+    // Results can differ from Encode(vec) for near-ties because of the rounding of the expansion.
+    void Encode(const float *const *vecs, long long n, uchar *codes) const;
+    void Encode(const std::vector<std::vector<float> > &vecs, UcharVecs *codes, int offset) const; // into (*codes)[offset:]
+
     // Given a PQ code, decode it
     std::vector<float> Decode(const std::vector<uchar> &code) const;
     std::vector<std::vector<float> > Decode(const UcharVecs &codes) const;  // Decode several codes at once
 
     // dtable[m][ks] : the distance between m-th subspace, ks-th codeword
     Array DTable(const std::vector<float> &query) const;
+    // Flat version: dtable[m * Ks + ks]. dtable must have M * Ks elements. Fast impl
+    void DTable(const float *query, float *dtable) const;
 
     // Give a DTable and PQ codes, compute an asymmetric distance
     float AD(const Array &dtable, const std::vector<uchar> &code) const;
     std::vector<float> AD(const Array &dtable,
                           const UcharVecs &codes) const;
     float AD(const Array &dtable, const UcharVecs &codes, int n) const; // Fast impl
+    float AD(const float *dtable, const uchar *code) const { // with a flat dtable. Fastest impl
+        float dist = 0;
+        for(int m = 0; m < m_M; ++m){
+            dist += dtable[m * m_Ks + code[m]];
+        }
+        return dist;
+    }
 
     // Just sort results
     static std::vector<std::pair<int, float> > Sort(const std::vector<float> &dists, int top_k = -1); // if top_k == -1, sort all
@@ -152,6 +182,12 @@ private:
 
     std::vector<Array> m_codewords; // [ns][ks][ds]
 
+    // The same codewords in a flat, transposed, and 64-byte aligned layout for SIMD kernels.
+    // m_codewordsT[(m * m_Ds + ds) * m_stride + ks] = m_codewords[m][ks][ds],
+    // where m_stride (>= m_Ks) is a multiple of 16 so that each row is aligned.
+    int m_stride;
+    std::vector<float, AlignedAllocator<float> > m_codewordsT;
+    std::vector<float> m_codewordNorms; // [m * m_Ks + ks] : ||m_codewords[m][ks]||^2
 
 };
 
@@ -7,11 +7,26 @@
 // This class is explained in Alg. 3 in Y. Matsui et al.,
 // "PQTable: Non-exhaustive Fast Search for
 // Product-quantized Codes using Hash Tables", IEEE TMM 2018
+//
+// Implementation notes:
+// A candidate is a fixed-size record (M <= 4 indices into the sorted distance tables).
+// Candidates form a tree: the children of a candidate are made by incrementing the index
+// of a subspace m >= "last", where "last" is the subspace incremented to make the candidate
+// itself. Each code has exactly one parent, whose distance is not larger than its own,
+// so a best-first traversal of the tree yields all codes in the order of distance
+// without a visited set. The heap is a flat array whose capacity is kept by Reset(),
+// so a generator that is reused across queries does not allocate at all.
+//
+// Usage:
+//   PQKeyGenerator key_gen(dtable, M, Ks);
+//   PQKey pqkey;
+//   while(key_gen.NextKey(&pqkey)){ /* pqkey.key, pqkey.dist */ }
+//   key_gen.Reset(next_dtable);  /* reuse for the next query */
 
 #include <opencv2/opencv.hpp>
+#include <cfloat>
 #include "pq.h"
 #include "code_to_key.h"
-#include <unordered_set>
 
 
 namespace pqtable {
@@ -31,58 +46,93 @@ public:
     PQKeyGenerator(const std::vector<float> &vec,
                    const std::vector<PQ::Array> &codewords);
 
-    void NextKey(PQKey *pq_key);
+    // From a precomputed flat distance table: dtable[m * Ks + ks] for m in [0, M).
+    // Use this to share one PQ::DTable among the generators and the AD computation,
+    // e.g., the t-th generator of a multi-table takes dtable + t * each_M * Ks.
+    PQKeyGenerator(const float *dtable, int M, int Ks);
+
+    // Restart for a new query (a distance table with the same M and Ks). No allocation
+    void Reset(const float *dtable);
+    void Reset(const float *dtable, int M, int Ks); // With new M and Ks
+
+    // Returns false if all Ks^M keys have been generated
+    bool NextKey(PQKey *pq_key);
+
+    // The distance of the key that NextKey() will return next. FLT_MAX if all keys have been generated
+    float NextDist() const {return m_heap.empty() ? FLT_MAX : m_heap.front().dist;}
+
+    // The same as NextKey, specialized for M at compile time so that the loops are unrolled.
+    // M must be the same as the M given to the constructor
+    template<int M>
+    bool NextKeyM(PQKey *pq_key);
 
 
 private:
     PQKeyGenerator();
 
+    static const int MAX_M = 4;
+    static const int MAX_KS = 256;
+
     int m_M;
     int m_Ks;
-    int m_Ds;
-
-    // --- DistKsId (element of m_sortedDTable) -----
-    struct DistKsId{
-        DistKsId() : dist(-1), ks(0), sorted_id(0) {}
-        DistKsId(float dist_, int ks_) : dist(dist_), ks(ks_), sorted_id(0) {}
-        float dist;
-        uchar ks;
-        uchar sorted_id; // After sorted, its id
-    };
-    std::vector<std::vector<DistKsId> > m_sortedDTable; // [m][sorted_id], where sorted_id is 0 - m_Ks
 
+    // Sorted distance tables. m_sortedDist[m][i] is the i-th smallest distance in the m-th
+    // subspace, and m_sortedKs[m][i] is its codeword id
+    float m_sortedDist[MAX_M][MAX_KS];
+    uchar m_sortedKs[MAX_M][MAX_KS];
 
-    // ---- Cand (element of priority queue. Cand contaisn M DistKsId.) ---
+    // ---- Cand (element of the heap). Fixed size ---
     struct Cand{
-        Cand() {}
-        Cand(const std::vector<DistKsId> &dist_ks_ids_);
-        void UpdateDist(); // from dist_ks_ids, compute dist
-
-        void ToUInt(uint *key) const;
-        void ToPQKey(PQKey *pq_key) const;
-
-        std::vector<DistKsId> dist_ks_ids;
-        float dist; // sum of dists in dist_ks_ids
-
+        float dist;          // sum of m_sortedDist[m][ids[m]], i.e., the same as PQ::AD of the code
+        uchar ids[MAX_M];    // sorted ids
+        uchar last;          // children increment ids[m] for m >= last
     };
-    std::vector<Cand> NextCands(const Cand &cand); // Expand cand, then create M new_cand
-
-
-    // -- PriorityQueue for cands ---
-    class PriorityQueue{
-    public:
-        //PriorityQueue(){m_identities.init(64);}
-        void Push(const Cand &cand);
-        void Pop(Cand *cand_dist_min);
-
-    private:
-        std::vector<Cand> m_cands;
-        std::unordered_set<uint> m_identities; // used for checking duplicate ids
+    struct CandGreater{
+        bool operator()(const Cand &c1, const Cand &c2) const {return c1.dist > c2.dist;}
     };
 
-    PriorityQueue m_candidate;
+    std::vector<Cand> m_heap; // min-heap on dist
 };
 
+
+template<int M>
+inline bool PQKeyGenerator::NextKeyM(PQKey *pq_key) {
+    assert(M == m_M);
+    if(m_heap.empty()){ // All codes were generated
+        return false;
+    }
+
+    // Pop the next-nearest code
+    std::pop_heap(m_heap.begin(), m_heap.end(), CandGreater());
+    Cand cand = m_heap.back();
+    m_heap.pop_back();
+
+    // Push its children
+    for(int m = cand.last; m < M; ++m){
+        int id = cand.ids[m];
+        if(id + 1 < m_Ks){
+            Cand child = cand;
+            child.ids[m] = (uchar) (id + 1);
+            child.dist = 0; // The exact sum in the order of PQ::AD, not parent + difference, so no rounding error accumulates
+            for(int m2 = 0; m2 < M; ++m2){
+                child.dist += m_sortedDist[m2][child.ids[m2]];
+            }
+            child.last = (uchar) m;
+            m_heap.push_back(child);
+            std::push_heap(m_heap.begin(), m_heap.end(), CandGreater());
+        }
+    }
+
+    // Sorted ids -> codes -> key
+    uchar code[M];
+    for(int m = 0; m < M; ++m){
+        code[m] = m_sortedKs[m][cand.ids[m]];
+    }
+    pq_key->key = CodeToKey::CodeToKeyM<M>(code);
+    pq_key->dist = cand.dist;
+    return true;
+}
+
 }
 
 #endif // PQTABLE_PQ_KEY_GENERATOR_H
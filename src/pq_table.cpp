@@ -1,8 +1,127 @@
 #include "pq_table.h"
+#include <chrono>
+#include <cstring>
+#include <omp.h>
 
 namespace pqtable {
 
-PQSingleTable::PQSingleTable(const std::vector<PQ::Array> &codewords, const UcharVecs &pq_codes) :
+// A context for each thread, used by the Query functions without a context
+static QueryContext &ThreadLocalContext()
+{
+    static thread_local QueryContext ctx;
+    return ctx;
+}
+
+// The first item of scores. (-1, FLT_MAX) if empty
+static std::pair<int, float> Top1(const std::vector<std::pair<int, float> > &scores)
+{
+    return scores.empty() ? std::pair<int, float>(-1, FLT_MAX) : scores[0];
+}
+
+std::pair<int, float> I_PQTable::Query(const std::vector<float> &query) const
+{
+    return Top1(Query(query, 1));
+}
+
+std::vector<std::pair<int, float> > I_PQTable::Query(const std::vector<float> &query, int top_k) const
+{
+    return Query(query, top_k, SearchParams(), NULL, NULL);
+}
+
+std::vector<std::pair<int, float> > I_PQTable::Query(const std::vector<float> &query, int top_k,
+                                                     const SearchParams &params, bool *is_exact, SearchStats *stats) const
+{
+    assert((int) query.size() == Dim());
+    std::vector<std::pair<int, float> > scores;
+    Query(&ThreadLocalContext(), query.data(), top_k, &scores, params, is_exact, stats);
+    return scores;
+}
+
+std::vector<std::vector<std::pair<int, float> > > I_PQTable::QueryBatch(const cv::Mat &queries, int top_k, int num_threads) const
+{
+    assert(queries.type() == CV_32FC1);
+    assert(queries.cols == Dim());
+    assert(0 < top_k);
+
+    std::vector<std::vector<std::pair<int, float> > > scores(queries.rows);
+    ParallelForWorkStealing(queries.rows, [&](int q){
+        Query(&ThreadLocalContext(), queries.ptr<float>(q), top_k, &scores[q]);
+    }, num_threads);
+    return scores;
+}
+
+// keys[n] = CodeToKey1(pq_codes[n][m_begin : m_begin + M]). Computed in parallel
+template<int M>
+static void ComputeKeysM(const UcharVecs &pq_codes, int m_begin, std::vector<uint> *keys)
+{
+    keys->resize(pq_codes.Size());
+    const uchar *data = pq_codes.RawDataPtr();
+    int D = pq_codes.Dim();
+    #pragma omp parallel for
+    for(int n = 0; n < pq_codes.Size(); ++n){
+        (*keys)[n] = CodeToKey::CodeToKeyM<M>(data + (unsigned long long) n * D + m_begin);
+    }
+}
+
+static void ComputeKeys(const UcharVecs &pq_codes, int m_begin, int M, std::vector<uint> *keys)
+{
+    assert(keys != NULL);
+    assert(0 <= m_begin && m_begin + M <= pq_codes.Dim());
+    if(M == 1){
+        ComputeKeysM<1>(pq_codes, m_begin, keys);
+    }else if(M == 2){
+        ComputeKeysM<2>(pq_codes, m_begin, keys);
+    }else if(M == 4){
+        ComputeKeysM<4>(pq_codes, m_begin, keys);
+    }else{
+        std::cerr << "Error M must be 1, 2, or 4, in ComputeKeys. M: " << M << std::endl;
+        exit(1);
+    }
+}
+
+// Checks the limits of SearchParams during a search
+class BudgetChecker{
+public:
+    BudgetChecker(const SearchParams &params) : m_params(params), m_numChecks(0) {
+        if(0 <= m_params.max_msec){
+            m_start = std::chrono::steady_clock::now();
+        }
+    }
+
+    // Returns true if any limit is reached
+    bool Exceeded(long long num_keys, long long num_verified) {
+        if(0 <= m_params.max_keys && m_params.max_keys <= num_keys){
+            return true;
+        }
+        if(0 <= m_params.max_verified && m_params.max_verified <= num_verified){
+            return true;
+        }
+        if(0 <= m_params.max_msec && (m_numChecks++ & 15) == 0){ // Read the clock every 16 checks
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - m_start;
+            if(m_params.max_msec <= elapsed.count()){
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    const SearchParams &m_params;
+    long long m_numChecks;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Removed ids written with a table, or none if the file does not exist (written by an older version)
+static std::shared_ptr<Tombstones> ReadTombstones(std::string dir_path, long long N)
+{
+    std::ifstream ifs(dir_path + "/removed.bin");
+    if(!ifs.is_open()){
+        return std::shared_ptr<Tombstones>(new Tombstones(N));
+    }
+    return std::shared_ptr<Tombstones>(new Tombstones(dir_path + "/removed.bin"));
+}
+
+PQSingleTable::PQSingleTable(const std::vector<PQ::Array> &codewords, const UcharVecs &pq_codes, bool compress) :
     m_PQ(codewords){
     assert(pq_codes.Dim() == m_PQ.GetM());
 
@@ -11,65 +130,178 @@ PQSingleTable::PQSingleTable(const std::vector<PQ::Array> &codewords, const Ucha
         assert(0);
     }
 
-    m_sHashTable.init(8 * m_PQ.GetM());
-    for(int n = 0; n < pq_codes.Size(); ++n){
-        uint key;
-        CodeToKey::CodeToKey1(m_PQ.GetM(), pq_codes.GetVec(n), &key);
-        m_sHashTable.insert(key, (uint) n);
+    // Bulk-load the table in parallel. The result is the same as inserting codes one by one
+    std::vector<uint> keys;
+    ComputeKeys(pq_codes, 0, m_PQ.GetM(), &keys);
+    m_sHashTable.bulk_load(8 * m_PQ.GetM(), keys.data(), keys.size()); // The table is read-only after construction
+    if(compress){
+        m_sHashTable.compress();
     }
+
+    m_removed.reset(new Tombstones(pq_codes.Size()));
+    m_numCompacted = 0;
+
+    SelectKernels();
 }
 
-PQSingleTable::PQSingleTable(std::string dir_path) :
+PQSingleTable::PQSingleTable(std::string dir_path, MappedFile::Warmup warmup) :
     m_PQ(PQ::ReadCodewords(dir_path + "/codeword.txt")){
     assert(dir_path.substr((int) dir_path.size() - 1) != "/"); // dir_path must be "som_dir". Not "some_dir/"
-    HelperSparseHashtable::Read(dir_path + "/table.bin", &m_sHashTable); // Read hash table
+    HelperSparseHashtable::Map(dir_path + "/table.bin", &m_sHashTable, warmup); // Map hash table
+
+    m_removed = ReadTombstones(dir_path, (long long) m_sHashTable.n_items);
+    m_numCompacted = m_removed->Count(); // Removed ids are not written to the table
+
+    SelectKernels();
 }
 
-std::pair<int, float> PQSingleTable::Query(const std::vector<float> &query) {
-    PQKeyGenerator key_gen(query, m_PQ.GetCodewords());
-    PQKey pqkey;
+PQSingleTable::PQSingleTable(const PQSingleTable &src, bool compact) :
+    m_PQ(src.m_PQ), m_removed(src.m_removed){
+    assert(compact);
+    // Ids removed from now on may remain in the table. They are counted as stale
+    m_numCompacted = m_removed->Count();
+    const Tombstones &removed = *m_removed;
+    m_sHashTable.filter(src.m_sHashTable, [&removed](uint id){return removed.Test(id);});
 
-    while(1){
-        key_gen.NextKey(&pqkey);
+    SelectKernels();
+}
+
+std::shared_ptr<I_PQTable> PQSingleTable::Compacted() const
+{
+    return std::shared_ptr<I_PQTable>((I_PQTable *) new PQSingleTable(*this, true));
+}
+
+std::shared_ptr<const UcharVecs> PQSingleTable::Codes() const
+{
+    // A key is the code itself (see CodeToKey::CodeToKeyM), so the code of each item is that of its bucket
+    const int M = m_PQ.GetM();
+    std::shared_ptr<UcharVecs> codes(new UcharVecs((int) Size(), M));
+    uchar *data = codes->MutableRawDataPtr();
+    std::vector<uint> buf;
+    m_sHashTable.for_each_index([&](UINT64 key){
         int sz;
-        uint *result = m_sHashTable.query(pqkey.key, &sz);
-        if(result != NULL){
-            return std::pair<int, float>(result[0], pqkey.dist); // return the first item
+        const uint *ids = m_sHashTable.query(key, &sz, &buf);
+        for(int i = 0; i < sz; ++i){
+            for(int m = 0; m < M; ++m){
+                data[(size_t) ids[i] * M + m] = (uchar) (key >> (8 * (M - 1 - m)));
+            }
         }
-    }
+    });
+    return codes;
 }
 
-std::vector<std::pair<int, float> > PQSingleTable::Query(const std::vector<float> &query, int top_k) {
-    assert(0 < top_k);
-
-    // If top_k = 1, use a top-1 version
-    if(top_k == 1){
-        std::vector<std::pair<int, float> > score;
-        score.push_back(Query(query));
-        return score;
+void PQSingleTable::SelectKernels()
+{
+    if(m_PQ.GetM() == 1){
+        m_search = &PQSingleTable::Search<1>;
+    }else if(m_PQ.GetM() == 2){
+        m_search = &PQSingleTable::Search<2>;
+    }else if(m_PQ.GetM() == 4){
+        m_search = &PQSingleTable::Search<4>;
+    }else{
+        std::cerr << "Error: M must be 1, 2, or 4 for single table. M: " << m_PQ.GetM() << std::endl;
+        exit(1);
     }
+}
 
-    std::vector<std::pair<int, float> > found_scores;
-    PQKeyGenerator key_gen(query, m_PQ.GetCodewords());
+void PQSingleTable::Query(QueryContext *ctx, const float *query, int top_k,
+                          std::vector<std::pair<int, float> > *scores,
+                          const SearchParams &params, bool *is_exact, SearchStats *stats) const {
+    (this->*m_search)(ctx, query, top_k, scores, params, is_exact, stats);
+}
 
+template<int M>
+void PQSingleTable::Search(QueryContext *ctx, const float *query, int top_k,
+                           std::vector<std::pair<int, float> > *scores,
+                           const SearchParams &params, bool *is_exact, SearchStats *stats) const {
+    assert(ctx != NULL && query != NULL && scores != NULL);
+    assert(0 < top_k);
+    ctx->m_dtable.resize(M * m_PQ.GetKs());
+    m_PQ.DTable(query, ctx->m_dtable.data());
+    if(ctx->m_keyGens.empty()){
+        ctx->m_keyGens.push_back(PQKeyGenerator(ctx->m_dtable.data(), M, m_PQ.GetKs()));
+    }else{
+        ctx->m_keyGens[0].Reset(ctx->m_dtable.data(), M, m_PQ.GetKs());
+    }
+    PQKeyGenerator &key_gen = ctx->m_keyGens[0];
+
+    // Keys are generated in the order of distance. So the items found first are the nearest ones.
+    // The distance of a key is the AD of the items in its bucket
+    std::vector<std::pair<int, float> > &found_scores = *scores;
+    found_scores.clear();
+    const Tombstones *removed = (0 < m_removed->Count()) ? m_removed.get() : NULL; // NULL: no check is needed
+    // When the work exceeds scan_cost, visiting all non-empty buckets is cheaper than walking further
+    // over (mostly empty) keys. The scan reads all bucket groups (2^b / 32) sequentially to find them. -1: never
+    bool limited = (0 <= params.max_keys || 0 <= params.max_verified || 0 <= params.max_msec);
+    long long scan_cost = (0 <= params.scan_ratio && !limited) ?
+                (long long) (params.scan_ratio * (m_sHashTable.size + m_sHashTable.n_buckets)) : -1;
+
+    BudgetChecker budget(params);
+    bool exact = true;
+    long long num_keys = 0;
     PQKey pqkey;
-    while(1){
-        key_gen.NextKey(&pqkey);
+    while((int) found_scores.size() < top_k){
+        if(budget.Exceeded(num_keys, (long long) found_scores.size())){ // Return the best-so-far
+            exact = false;
+            break;
+        }
+        if(0 <= scan_cost && scan_cost <= num_keys + (long long) found_scores.size()){
+            Scan<M>(ctx, top_k, scores);
+            num_keys += m_sHashTable.n_buckets;
+            break;
+        }
+        if(!key_gen.NextKeyM<M>(&pqkey)){ // All keys were visited, i.e., top_k > the number of items
+            break;
+        }
+        ++num_keys;
         int sz;
-        uint *result = m_sHashTable.query(pqkey.key, &sz);
+        const uint *result = m_sHashTable.query(pqkey.key, &sz, &ctx->m_postings);
         if(result != NULL){ // found items
-            for(int i = 0; i < sz; ++i){
-                found_scores.push_back(std::pair<int, float>(result[i], pqkey.dist));
+            for(int i = 0; i < sz && (int) found_scores.size() < top_k; ++i){
+                if(removed == NULL || !removed->Test(result[i])){
+                    found_scores.push_back(std::pair<int, float>(result[i], pqkey.dist));
+                }
             }
         }
-        if(top_k <= (int) found_scores.size()){
-            found_scores.resize(top_k);
-            found_scores.shrink_to_fit();
-            return found_scores;
-        }
+    }
+
+    if(is_exact != NULL){
+        *is_exact = exact;
+    }
+    if(stats != NULL){
+        stats->num_probes += num_keys;
+        stats->num_verified += (long long) found_scores.size();
     }
 }
 
+template<int M>
+void PQSingleTable::Scan(QueryContext *ctx, int top_k, std::vector<std::pair<int, float> > *scores) const
+{
+    const Tombstones *removed = (0 < m_removed->Count()) ? m_removed.get() : NULL;
+    const float *dtable = ctx->m_dtable.data();
+    const int Ks = m_PQ.GetKs();
+    TopK &topk = ctx->m_topk;
+    topk.Reset(top_k);
+    m_sHashTable.for_each_index([&](UINT64 key){
+        // A key is the code itself (see CodeToKey::CodeToKeyM), so the AD of its items is the sum of the table
+        float dist = 0;
+        for(int m = 0; m < M; ++m){
+            dist += dtable[m * Ks + ((key >> (8 * (M - 1 - m))) & 255)];
+        }
+        if(topk.Threshold() <= dist){
+            return;
+        }
+        int sz;
+        const uint *result = m_sHashTable.query(key, &sz, &ctx->m_postings);
+        for(int i = 0; i < sz; ++i){
+            if((removed == NULL || !removed->Test(result[i])) && !topk.Push((int) result[i], dist)){
+                break; // Full. The rest of the bucket has the same dist
+            }
+        }
+    });
+    topk.Sorted(scores);
+}
+
 void PQSingleTable::Write(std::string dir_path){
     assert(dir_path.substr((int) dir_path.size() - 1) != "/"); // dir_path must be "some_dir". Not "some_dir/"
 
@@ -85,189 +317,280 @@ void PQSingleTable::Write(std::string dir_path){
     // Write codewords
     PQ::WriteCodewords(dir_path + "/codeword.txt", m_PQ.GetCodewords());
 
-    // Write table
-    HelperSparseHashtable::Write(dir_path + "/table.bin", m_sHashTable);
+    // Write table. Removed ids are dropped
+    if(0 < NumStale()){
+        const Tombstones &removed = *m_removed;
+        FrozenSparseHashtable live;
+        live.filter(m_sHashTable, [&removed](uint id){return removed.Test(id);});
+        HelperSparseHashtable::Write(dir_path + "/table.bin", live);
+    }else{
+        HelperSparseHashtable::Write(dir_path + "/table.bin", m_sHashTable);
+    }
+
+    // Write removed ids. This also records the number of items, which the table alone does not tell
+    m_removed->Write(dir_path + "/removed.bin");
 }
 
 
 
 
 
-PQMultiTable::PQMultiTable(const std::vector<PQ::Array> &codewords, const UcharVecs &pq_codes, int T)
-    : m_PQ(codewords)
+PQMultiTable::PQMultiTable(const std::vector<PQ::Array> &codewords, const UcharVecs &pq_codes, int T, bool compress)
+    : PQMultiTable(codewords, std::shared_ptr<const UcharVecs>(new UcharVecs(pq_codes)), T, compress)
+{}
+
+PQMultiTable::PQMultiTable(const std::vector<PQ::Array> &codewords, std::shared_ptr<const UcharVecs> pq_codes, int T, bool compress)
+    : m_PQ(codewords), m_codes(pq_codes)
 {
-    assert(1 < T && m_PQ.GetM() % T == 0);
+    assert(1 < T && T < 256 && m_PQ.GetM() % T == 0); // T < 256 for CandidateCounter
     m_T = T;
-
-    // Divide codeword into codewords_each
-    DivideCodewords(codewords, m_T, &m_codewordsEach);
+    m_schedule = SCHEDULE_ROUND_ROBIN;
 
     // Setup hashtables
     int each_M = m_PQ.GetM() / m_T;
+    // Bulk-load each table in parallel. Each bulk-load uses all cores
     m_sHashTableEach.resize(m_T);
-
+    std::vector<uint> keys;
     for(int t = 0; t < m_T; ++t){
-        m_sHashTableEach[t].init(8 * each_M);
-    }
-
-    for(int n = 0; n < pq_codes.Size(); ++n){
-        std::vector<uchar> code = pq_codes.GetVec(n);
-        for(int t = 0; t < m_T; ++t){
-            uint key;
-            CodeToKey::CodeToKey1(each_M,
-                                  std::vector<uchar>(code.begin() + each_M * t, code.begin() + each_M * (t + 1)),
-                                  &key);
-            m_sHashTableEach[t].insert(key, (uint) n);
+        ComputeKeys(*m_codes, each_M * t, each_M, &keys);
+        m_sHashTableEach[t].bulk_load(8 * each_M, keys.data(), keys.size()); // read-only after construction
+        if(compress){
+            m_sHashTableEach[t].compress();
         }
     }
 
-    // Store original codes
-    m_codes = pq_codes;
+    m_removed.reset(new Tombstones(m_codes->Size()));
+    m_numCompacted = 0;
+
+    SelectKernels();
 }
 
-PQMultiTable::PQMultiTable(std::string dir_path) :  // Read from saved files (a dir contaings files)
+PQMultiTable::PQMultiTable(std::string dir_path, MappedFile::Warmup warmup) :  // Read from saved files (a dir contaings files)
     m_PQ(PQ::ReadCodewords(dir_path + "/codeword.txt"))
 {
     // Read T
     std::ifstream ifs(dir_path + "/T.txt");
     assert(ifs.is_open());
     ifs >> m_T;
-
-    // Set codesords each
-    DivideCodewords(m_PQ.GetCodewords(), m_T, &m_codewordsEach);
+    m_schedule = SCHEDULE_ROUND_ROBIN;
 
     // Read tables
     m_sHashTableEach.resize(m_T);
     for(int t = 0;t < m_T; ++t){
-        HelperSparseHashtable::Read(dir_path + "/table" + std::to_string(t) + ".bin", &(m_sHashTableEach[t]));
+        HelperSparseHashtable::Map(dir_path + "/table" + std::to_string(t) + ".bin", &(m_sHashTableEach[t]), warmup);
     }
 
     // Set pqcode
-    UcharVecs::Read(dir_path + "/pqcode.bin", &m_codes);
+    std::shared_ptr<UcharVecs> codes(new UcharVecs);
+    UcharVecs::Map(dir_path + "/pqcode.bin", codes.get(), warmup);
+    m_codes = codes;
+
+    m_removed = ReadTombstones(dir_path, m_codes->Size());
+    m_numCompacted = m_removed->Count(); // Removed ids are not written to the tables
 
+    SelectKernels();
 }
 
-std::pair<int, float> PQMultiTable::Query(const std::vector<float> &query) // fot top-1
+PQMultiTable::PQMultiTable(const PQMultiTable &src, bool compact)
+    : m_schedule(src.m_schedule), m_T(src.m_T), m_PQ(src.m_PQ), m_codes(src.m_codes), m_removed(src.m_removed)
 {
-    assert( (int) query.size() % m_T == 0);
-    std::unordered_map<uint, int> count;
-
-
-    PQ::Array dtable = m_PQ.DTable(query);
-
-    // Setup key generator
-    std::vector<PQKeyGenerator> key_gens;
-    int each_D = (int) query.size() / m_T;
+    assert(compact);
+    // Ids removed from now on may remain in the tables. They are counted as stale
+    m_numCompacted = m_removed->Count();
+    const Tombstones &removed = *m_removed;
+    m_sHashTableEach.resize(m_T);
     for(int t = 0; t < m_T; ++t){
-        key_gens.push_back(PQKeyGenerator(std::vector<float>(query.begin() + each_D * t,
-                                                             query.begin() + each_D * (t + 1)),
-                                          m_codewordsEach[t]));
+        m_sHashTableEach[t].filter(src.m_sHashTableEach[t], [&removed](uint id){return removed.Test(id);});
     }
 
+    SelectKernels();
+}
 
-    std::vector<std::pair<int, float> > candidates;
-    PQKey pqkey;
-    while(1){
-        // For each table, compute nearest ones
-        for(int t = 0; t < m_T; ++t){
-            key_gens[t].NextKey(&pqkey);
-            int sz;
-            uint *result = m_sHashTableEach[t].query(pqkey.key, &sz);
-            if(result != NULL){ // found!
-                for(int i = 0; i < sz; ++i){
-                    uint id = result[i];
-                    int c = ++count[id];
-
-                    if(c == 1){ // if this is the first insert
-                        candidates.emplace_back(id, m_PQ.AD(dtable, m_codes, id)); // Compute AD and store
-                    }
-                    if(c == m_T){ // m_T th times checked
-                        float min_dist = FLT_MAX;
-                        int min_i = -1;
-                        for(const auto &cand : candidates){ // Evaluate candidates in count
-                            if(cand.second < min_dist){
-                                min_dist = cand.second;
-                                min_i = cand.first;
-                            }
-                        }
-                        assert(min_i != -1);
-                        return std::pair<int, float>(min_i, min_dist);
-                    }
-                }
-            }
-        }
+std::shared_ptr<I_PQTable> PQMultiTable::Compacted() const
+{
+    return std::shared_ptr<I_PQTable>((I_PQTable *) new PQMultiTable(*this, true));
+}
 
+void PQMultiTable::SelectKernels()
+{
+    int each_M = m_PQ.GetM() / m_T;
+    if(each_M == 1){
+        m_search = &PQMultiTable::Search<1>;
+    }else if(each_M == 2){
+        m_search = &PQMultiTable::Search<2>;
+    }else if(each_M == 4){
+        m_search = &PQMultiTable::Search<4>;
+    }else{
+        std::cerr << "Error: M/T must be 1, 2, or 4 for multi table. M/T: " << each_M << std::endl;
+        exit(1);
     }
 }
 
-std::vector<std::pair<int, float> > PQMultiTable::Query(const std::vector<float> &query, int top_k) // fot top-k
+void PQMultiTable::Query(QueryContext *ctx, const float *query, int top_k,
+                         std::vector<std::pair<int, float> > *scores,
+                         const SearchParams &params, bool *is_exact, SearchStats *stats) const
+{
+    (this->*m_search)(ctx, query, top_k, scores, params, is_exact, stats);
+}
+
+template<int EACH_M>
+void PQMultiTable::Search(QueryContext *ctx, const float *query, int top_k,
+                          std::vector<std::pair<int, float> > *scores,
+                          const SearchParams &params, bool *is_exact, SearchStats *stats) const
 {
+    assert(ctx != NULL && query != NULL && scores != NULL);
     assert(0 < top_k);
-    assert( (int) query.size() % m_T == 0);
 
-    // If top_k = 1, use a top-1 version
-    if(top_k == 1){
-        std::vector<std::pair<int, float> > score;
-        score.push_back(Query(query));
-        return score;
-    }
+    CandidateCounter &count = ctx->m_counter; // count[id]: how many times id is found. Used to find new ids
+    count.Reset(m_codes->Size());
+    const Tombstones *removed = (0 < m_removed->Count()) ? m_removed.get() : NULL; // NULL: no check is needed
 
-    std::unordered_map<uint, int> count;
+    // A distance table is computed once, and shared by the key generators and AD
+    std::vector<float> &dtable = ctx->m_dtable;
+    dtable.resize(m_PQ.GetM() * m_PQ.GetKs());
+    m_PQ.DTable(query, dtable.data());
 
-    PQ::Array dtable = m_PQ.DTable(query);
+    // Setup key generators. They are reused
+    std::vector<PQKeyGenerator> &key_gens = ctx->m_keyGens;
+    for(int t = 0; t < m_T; ++t){
+        const float *dtable_t = dtable.data() + EACH_M * t * m_PQ.GetKs();
+        if(t < (int) key_gens.size()){
+            key_gens[t].Reset(dtable_t, EACH_M, m_PQ.GetKs());
+        }else{
+            key_gens.push_back(PQKeyGenerator(dtable_t, EACH_M, m_PQ.GetKs()));
+        }
+    }
 
-    // Setup key generator
-    std::vector<PQKeyGenerator> key_gens;
-    int each_D = (int) query.size() / m_T;
+    // Threshold algorithm (R. Fagin et al., "Optimal Aggregation Algorithms for Middleware", PODS 2001).
+    // Each generator yields keys in the order of distance. So an id which has not been found yet
+    // has the t-th partial distance >= next_dist[t], the distance of the next key of the t-th generator,
+    // i.e., its AD is >= bound = sum_t next_dist[t]. Since the AD of each found id is computed at once,
+    // the search can stop as soon as the k-th nearest found one is not farther than the bound.
+    // The result is exact in terms of AD
+    std::vector<float> &next_dist = ctx->m_nextDist;
+    next_dist.resize(m_T);
     for(int t = 0; t < m_T; ++t){
-        key_gens.push_back(PQKeyGenerator(std::vector<float>(query.begin() + each_D * t,
-                                                             query.begin() + each_D * (t + 1)),
-                                          m_codewordsEach[t]));
+        next_dist[t] = key_gens[t].NextDist();
     }
 
+    TopK &topk = ctx->m_topk; // The nearest top_k candidates so far
+    topk.Reset(top_k);
+
+    Schedule schedule = (params.schedule == -1) ? m_schedule : (Schedule) params.schedule;
+
+    // For SCHEDULE_COST_AWARE. gain[t]: the recent increase of the bound per cost by probing the t-th table
+    std::vector<float> &gain = ctx->m_gain;
+    gain.assign(m_T, FLT_MAX); // FLT_MAX: each table is probed once first
 
-    std::vector<std::pair<int, float> > candidates;
+    // When the work exceeds scan_cost, scanning all codes is cheaper than walking further (-1: never).
+    // A lookup and an AD computation are about the same cost
+    bool limited = (0 <= params.max_keys || 0 <= params.max_verified || 0 <= params.max_msec);
+    long long scan_cost = (0 <= params.scan_ratio && !limited) ? (long long) (params.scan_ratio * m_codes->Size()) : -1;
 
+    BudgetChecker budget(params);
+    bool exact = true;
+    long long num_keys = 0;
+    long long num_verified = 0;
     PQKey pqkey;
+    int t = m_T - 1;
     while(1){
-        // For each table, compute nearest ones
-        for(int t = 0; t < m_T; ++t){
-            key_gens[t].NextKey(&pqkey);
-            int sz;
-            uint *result = m_sHashTableEach[t].query(pqkey.key, &sz);
-            if(result != NULL){ // found!
-                for(int i = 0; i < sz; ++i){
-                    uint id = result[i];
-                    int c = ++count[id];
-
-                    if(c == 1){ // if this is the first insert
-                        candidates.emplace_back(id, m_PQ.AD(dtable, m_codes, id)); // Compute AD and store
-                    }
-                    if(c == m_T){ // m_T th times checked
-                        float dist_min = m_PQ.AD(dtable, m_codes, id); // this computation is redundant.. Set bound
-
-                        // From candidates, find element whose dist is less than dist_min
-                        auto pos = std::partition(candidates.begin(), candidates.end(),
-                                                  [&](const std::pair<int, float> &p){return p.second <= dist_min;});
-                        int k_less_than_dist_min = std::distance(candidates.begin(), pos);
-
-                        // If enough number of elemets have dist less than dist_min,
-                        if(top_k <= k_less_than_dist_min){
-                            candidates.resize(k_less_than_dist_min);
-                            std::partial_sort(candidates.begin(), candidates.begin() + top_k, candidates.end(),
-                                              [](const std::pair<int, float> &p1, const std::pair<int, float> &p2){return p1.second < p2.second;});
-                            candidates.resize(top_k);
-                            candidates.shrink_to_fit();
-                            return candidates;
-                        }
-                    }
+        float bound = 0;
+        for(int s = 0; s < m_T; ++s){
+            bound += next_dist[s];
+        }
+        if(topk.Threshold() <= bound){ // No unseen id can enter the top_k
+            break;
+        }
+        if(budget.Exceeded(num_keys, num_verified)){ // Return the best-so-far
+            exact = false;
+            break;
+        }
+        if(0 <= scan_cost && scan_cost <= num_keys + num_verified){
+            Scan(ctx, dtable.data(), top_k, &topk);
+            num_verified += m_codes->Size();
+            break;
+        }
+
+        // Select a table to probe
+        if(schedule == SCHEDULE_ROUND_ROBIN){
+            t = (t + 1) % m_T;
+        }else if(schedule == SCHEDULE_NEAREST_FIRST){
+            t = (int) (std::min_element(next_dist.begin(), next_dist.end()) - next_dist.begin());
+        }else{ // SCHEDULE_COST_AWARE
+            t = (int) (std::max_element(gain.begin(), gain.end()) - gain.begin());
+        }
+
+        key_gens[t].NextKeyM<EACH_M>(&pqkey);
+        next_dist[t] = key_gens[t].NextDist(); // FLT_MAX if all keys were visited, i.e., all ids were found
+        ++num_keys;
+        int num_new = 0;
+        int sz;
+        const uint *result = m_sHashTableEach[t].query(pqkey.key, &sz, &ctx->m_postings);
+        if(result != NULL){ // found!
+            // The ids found for the first time are verified as a batch. Their codes are prefetched
+            // (see AsymDists), so the cache misses of the random accesses to the codes overlap
+            std::vector<uint> &new_ids = ctx->m_newIds;
+            if((int) new_ids.size() < sz){
+                new_ids.resize(sz);
+                ctx->m_newDists.resize(sz);
+            }
+            for(int i = 0; i < sz; ++i){
+                uint id = result[i];
+                if(count.Increment(id) == 1 && (removed == NULL || !removed->Test(id))){ // if this is the first insert of a live id
+                    new_ids[num_new++] = id;
                 }
             }
+            float *new_dists = ctx->m_newDists.data();
+            AsymDists(dtable.data(), m_PQ.GetM(), m_PQ.GetKs(), m_codes->RawDataPtr(), new_ids.data(), num_new, new_dists);
+            for(int i = 0; i < num_new; ++i){
+                topk.Push(new_ids[i], new_dists[i]);
+            }
         }
+        num_verified += num_new;
+        if(schedule == SCHEDULE_COST_AWARE){
+            // Cost: a lookup plus the AD computations, which are about the same cost each
+            float g = (next_dist[t] - pqkey.dist) / (1 + num_new);
+            gain[t] = (gain[t] == FLT_MAX) ? g : 0.5f * (gain[t] + g);
+        }
+    }
+
+    if(is_exact != NULL){
+        *is_exact = exact;
+    }
+    if(stats != NULL){
+        stats->num_probes += num_keys;
+        stats->num_verified += num_verified;
     }
+    topk.Sorted(scores); // Less than top_k if top_k > the number of items
 }
 
 
+void PQMultiTable::Scan(QueryContext *ctx, const float *dtable, int top_k, TopK *topk) const
+{
+    const Tombstones *removed = (0 < m_removed->Count()) ? m_removed.get() : NULL;
+    const long long N = m_codes->Size();
+    const int CHUNK = 1024; // ids of a chunk are scanned at once
+    std::vector<uint> &ids = ctx->m_newIds;
+    if((int) ids.size() < CHUNK){
+        ids.resize(CHUNK);
+        ctx->m_newDists.resize(CHUNK);
+    }
+    float *dists = ctx->m_newDists.data();
+
+    topk->Reset(top_k); // The ids found so far are pushed again by the scan
+    for(long long begin = 0; begin < N; begin += CHUNK){
+        int n = (int) std::min((long long) CHUNK, N - begin);
+        for(int i = 0; i < n; ++i){
+            ids[i] = (uint) (begin + i);
+        }
+        AsymDists(dtable, m_PQ.GetM(), m_PQ.GetKs(), m_codes->RawDataPtr(), ids.data(), n, dists);
+        for(int i = 0; i < n; ++i){
+            if(dists[i] < topk->Threshold() && (removed == NULL || !removed->Test(ids[i]))){
+                topk->Push((int) ids[i], dists[i]);
+            }
+        }
+    }
+}
 
 void PQMultiTable::Write(std::string dir_path){
     assert(dir_path.substr((int) dir_path.size() - 1) != "/"); // dir_path must be "some_dir". Not "some_dir/"
@@ -284,74 +607,610 @@ void PQMultiTable::Write(std::string dir_path){
     assert(ofs.is_open());
     ofs << m_T;
 
-    // Write tables
+    // Write tables. Removed ids are dropped
+    const Tombstones &removed = *m_removed;
     for(int t = 0; t < m_T; ++t){
-        HelperSparseHashtable::Write(dir_path + "/table" + std::to_string(t) + ".bin", m_sHashTableEach[t]);
+        if(0 < NumStale()){
+            FrozenSparseHashtable live;
+            live.filter(m_sHashTableEach[t], [&removed](uint id){return removed.Test(id);});
+            HelperSparseHashtable::Write(dir_path + "/table" + std::to_string(t) + ".bin", live);
+        }else{
+            HelperSparseHashtable::Write(dir_path + "/table" + std::to_string(t) + ".bin", m_sHashTableEach[t]);
+        }
     }
 
     // Write pq codes
-    UcharVecs::Write(dir_path + "/pqcode.bin", m_codes);
+    UcharVecs::Write(dir_path + "/pqcode.bin", *m_codes);
+
+    // Write removed ids
+    m_removed->Write(dir_path + "/removed.bin");
+}
+
+
+
+
+PQFlatTable::PQFlatTable(const std::vector<PQ::Array> &codewords, const UcharVecs &pq_codes)
+    : PQFlatTable(codewords, std::shared_ptr<const UcharVecs>(new UcharVecs(pq_codes)))
+{}
+
+PQFlatTable::PQFlatTable(const std::vector<PQ::Array> &codewords, std::shared_ptr<const UcharVecs> pq_codes)
+    : m_PQ(codewords), m_codes(pq_codes)
+{
+    assert(m_codes->Dim() == m_PQ.GetM());
+    assert(m_PQ.GetM() <= 256); // The sums of the fast scan do not saturate
+    m_removed.reset(new Tombstones(m_codes->Size()));
+    BuildBlocks();
 }
 
-void PQMultiTable::DivideCodewords(const std::vector<PQ::Array> &codewords, int T, std::vector<std::vector<PQ::Array> > *codewords_each){
-    assert(codewords_each != NULL);
-    int M = (int) codewords.size();
-    // Divide codeword into codewords_each
-    codewords_each->resize(T);
-    int each_M = M / T;
+PQFlatTable::PQFlatTable(std::string dir_path, MappedFile::Warmup warmup)
+    : m_PQ(PQ::ReadCodewords(dir_path + "/codeword.txt"))
+{
+    std::shared_ptr<UcharVecs> codes(new UcharVecs);
+    UcharVecs::Map(dir_path + "/pqcode.bin", codes.get(), warmup);
+    m_codes = codes;
+    m_removed = ReadTombstones(dir_path, m_codes->Size());
+    BuildBlocks(); // Not saved. Built by a pass over the codes
+}
+
+void PQFlatTable::BuildBlocks()
+{
+    const long long N = m_codes->Size();
+    const int M = m_PQ.GetM();
+    const int B = IsFastScan() ? (M + 1) / 2 : M; // Bytes per code in the blocked layout
+    long long num_blocks = (N + 31) / 32;
+    std::shared_ptr<std::vector<uchar, AlignedAllocator<uchar> > > blocks(
+                new std::vector<uchar, AlignedAllocator<uchar> >(num_blocks * B * 32, 0)); // Padded items are 0
+    const uchar *codes = m_codes->RawDataPtr();
+    uchar *dst = blocks->data();
+    #pragma omp parallel for
+    for(long long b = 0; b < num_blocks; ++b){
+        for(int j = 0; j < 32 && b * 32 + j < N; ++j){
+            const uchar *code = codes + (b * 32 + j) * M;
+            for(int m = 0; m < M; ++m){
+                if(IsFastScan()){ // Two 4-bit elements per byte
+                    dst[(b * B + m / 2) * 32 + j] |= (uchar) (code[m] << (4 * (m % 2)));
+                }else{
+                    dst[(b * B + m) * 32 + j] = code[m];
+                }
+            }
+        }
+    }
+    m_blocks = blocks;
+}
+
+std::shared_ptr<I_PQTable> PQFlatTable::Compacted() const
+{
+    return std::shared_ptr<I_PQTable>((I_PQTable *) new PQFlatTable(*this)); // Shares all
+}
+
+void PQFlatTable::Query(QueryContext *ctx, const float *query, int top_k,
+                        std::vector<std::pair<int, float> > *scores,
+                        const SearchParams &params, bool *is_exact, SearchStats *stats) const
+{
+    assert(ctx != NULL && query != NULL && scores != NULL);
+    assert(0 < top_k);
+    const int M = m_PQ.GetM();
+    const int Ks = m_PQ.GetKs();
+
+    std::vector<float> &dtable = ctx->m_dtable;
+    dtable.resize(M * Ks);
+    m_PQ.DTable(query, dtable.data());
+
+    // For the fast scan, each table is quantized to 8 bits: luts[m][ks] = floor((dtable[m][ks] - min_m) / delta),
+    // where delta is common to all m. Then bias + delta * sum_m luts[m][code[m]] <= AD, where bias = sum_m min_m
+    std::vector<uchar> &luts = ctx->m_luts;
+    float bias = 0;
+    float delta = 0;
+    if(IsFastScan()){
+        luts.assign((M + 1) / 2 * 32, 0);
+        for(int m = 0; m < M; ++m){
+            const float *row = dtable.data() + m * Ks;
+            float lo = *std::min_element(row, row + Ks);
+            float hi = *std::max_element(row, row + Ks);
+            bias += lo;
+            delta = std::max(delta, hi - lo);
+        }
+        delta = (0 < delta) ? delta / 255 : 1;
+        for(int m = 0; m < M; ++m){
+            const float *row = dtable.data() + m * Ks;
+            float lo = *std::min_element(row, row + Ks);
+            for(int ks = 0; ks < Ks; ++ks){
+                luts[m * 16 + ks] = (uchar) std::min(255.0f, std::floor((row[ks] - lo) / delta));
+            }
+        }
+    }
+
+    // With scan_threads, a large table is split among threads, each with its own top-k (kept in ctx)
+    // and its share of the limits, and the top-ks are merged
+    const long long num_blocks = (Size() + 31) / 32;
+    const long long PARALLEL_MIN_BLOCKS = 1 << 14; // 2^19 items. Smaller tables are scanned by one thread
+    int num_threads = (params.scan_threads == -1) ? omp_get_max_threads() : params.scan_threads;
+    TopK &topk = ctx->m_topk;
+    topk.Reset(top_k);
+    bool exact = true;
+    long long num_scanned = 0; // Blocks
+    long long num_verified = 0;
+    if(num_threads <= 1 || num_blocks < PARALLEL_MIN_BLOCKS){
+        BudgetChecker budget(params);
+        long long b_end = ScanBlocks(dtable.data(), luts.data(), bias, delta, 0, num_blocks, &budget, &topk);
+        exact = (b_end == num_blocks);
+        num_scanned = b_end;
+        num_verified = std::min(b_end * 32, Size());
+    }else{
+        std::vector<TopK> &locals = ctx->m_scanTopKs;
+        if((int) locals.size() < num_threads){
+            locals.resize(num_threads);
+        }
+        for(int t = 0; t < num_threads; ++t){
+            locals[t].Reset(top_k);
+        }
+        int num_stopped = 0;
+        #pragma omp parallel num_threads(num_threads) reduction(+:num_stopped, num_scanned, num_verified)
+        {
+            int nt = omp_get_num_threads(); // Can be less than num_threads
+            int tid = omp_get_thread_num();
+            SearchParams share = params;
+            if(0 <= params.max_keys){
+                share.max_keys = params.max_keys / nt;
+            }
+            if(0 <= params.max_verified){
+                share.max_verified = params.max_verified / nt;
+            }
+            BudgetChecker budget(share);
+            long long b_begin = num_blocks * tid / nt;
+            long long b_end = num_blocks * (tid + 1) / nt;
+            long long b_stop = ScanBlocks(dtable.data(), luts.data(), bias, delta, b_begin, b_end, &budget, &locals[tid]);
+            num_stopped += (b_stop != b_end);
+            num_scanned += b_stop - b_begin;
+            num_verified += std::min(b_stop * 32, Size()) - b_begin * 32;
+        }
+        exact = (num_stopped == 0);
+        for(int t = 0; t < num_threads; ++t){
+            locals[t].Sorted(&ctx->m_scanScores); // Empty for the threads which did not run
+            for(const auto &score : ctx->m_scanScores){
+                if(!topk.Push(score.first, score.second)){
+                    break; // Scores are sorted. The rest cannot enter either
+                }
+            }
+        }
+    }
+
+    if(is_exact != NULL){
+        *is_exact = exact;
+    }
+    if(stats != NULL){
+        stats->num_probes += num_scanned;
+        stats->num_verified += num_verified;
+    }
+    topk.Sorted(scores);
+}
 
-    for(int t = 0; t < T; ++t){
-        (*codewords_each)[t].assign(codewords.begin() + each_M * t,
-                                    codewords.begin() + each_M * (t + 1));
+long long PQFlatTable::ScanBlocks(const float *dtable, const uchar *luts, float bias, float delta,
+                                  long long b_begin, long long b_end, BudgetChecker *budget, TopK *topk) const
+{
+    const Tombstones *removed = (0 < m_removed->Count()) ? m_removed.get() : NULL;
+    const long long N = Size();
+    const int M = m_PQ.GetM();
+    const int B = IsFastScan() ? (M + 1) / 2 : M;
+    const uchar *codes = m_codes->RawDataPtr();
+    const int CHUNK_BLOCKS = 32; // Blocks scanned at once. The results (4KB at most) stay in L1
+
+    // An item can enter the top-k only if its quantized sum is <= QMax(threshold). The margin and +1
+    // absorb the rounding errors of the quantization
+    auto QMax = [bias, delta](float threshold) -> unsigned short {
+        if(threshold == FLT_MAX){
+            return 65535;
+        }
+        float margin = 1e-5f * (std::fabs(threshold) + std::fabs(bias));
+        float qmax = std::floor((threshold - bias + margin) / delta) + 1;
+        return (unsigned short) std::max(0.0f, std::min(65535.0f, qmax));
+    };
+
+    float dists[CHUNK_BLOCKS * 32];
+    unsigned short qsums[CHUNK_BLOCKS * 32];
+    unsigned int masks[CHUNK_BLOCKS];
+    for(long long b = b_begin; b < b_end; b += CHUNK_BLOCKS){
+        if(budget->Exceeded(b - b_begin, std::min(b * 32, N) - b_begin * 32)){ // Return the best-so-far
+            return b;
+        }
+        long long nb = std::min((long long) CHUNK_BLOCKS, b_end - b);
+        int n = (int) std::min(nb * 32, N - b * 32); // Padded items are ignored
+        if(IsFastScan()){
+            // Most blocks have no candidate, i.e., masks[k] == 0. qmax may decrease within a chunk,
+            // so each candidate is checked again
+            unsigned short qmax = QMax(topk->Threshold());
+            FastScanBlocked(luts, M, m_blocks->data() + b * B * 32, nb, qmax, qsums, masks);
+            for(int k = 0; k < nb; ++k){
+                for(unsigned int mask = masks[k]; mask != 0; mask &= mask - 1){
+                    int i = k * 32 + __builtin_ctz(mask);
+                    long long id = b * 32 + i;
+                    if(n <= i || qmax < qsums[i] || (removed != NULL && removed->Test(id))){
+                        continue;
+                    }
+                    if(topk->Push((int) id, m_PQ.AD(dtable, codes + id * M))){
+                        qmax = QMax(topk->Threshold());
+                    }
+                }
+            }
+        }else{
+            AsymDistsBlocked(dtable, M, m_PQ.GetKs(), m_blocks->data() + b * B * 32, nb, dists);
+            float threshold = topk->Threshold();
+            for(int i = 0; i < n; ++i){
+                long long id = b * 32 + i;
+                if(dists[i] < threshold && (removed == NULL || !removed->Test(id))){
+                    topk->Push((int) id, dists[i]);
+                    threshold = topk->Threshold();
+                }
+            }
+        }
     }
+    return b_end;
 }
 
-PQTable::PQTable(const std::vector<PQ::Array> &codewords, const UcharVecs &pq_codes, int T)
+void PQFlatTable::Write(std::string dir_path){
+    assert(dir_path.substr((int) dir_path.size() - 1) != "/"); // dir_path must be "some_dir". Not "some_dir/"
+
+    std::string cmd = "mkdir -p " + dir_path;
+    assert(!system(cmd.c_str())); // Create a directory where table files are written
+
+    // Write codewords;
+    PQ::WriteCodewords(dir_path + "/codeword.txt", m_PQ.GetCodewords());
+
+    // Write "T". 0 means PQFlatTable
+    std::ofstream ofs(dir_path + "/T.txt");
+    assert(ofs.is_open());
+    ofs << 0;
+
+    // Write pq codes. The blocked layout is built again when read
+    UcharVecs::Write(dir_path + "/pqcode.bin", *m_codes);
+
+    // Write removed ids
+    m_removed->Write(dir_path + "/removed.bin");
+}
+
+
+// The nearest T to T_wish (in log scale) that a table supports, i.e., M % T == 0 and M / T is 1, 2, or 4
+static int SupportedT(int M, double T_wish)
 {
-    // If T == -1, then the best T is automatically selected
+    int best_T = -1;
+    for(int each_M : {4, 2, 1}){
+        if(M % each_M == 0){
+            int T = M / each_M;
+            if(best_T == -1 || std::fabs(std::log2(T) - std::log2(T_wish)) < std::fabs(std::log2(best_T) - std::log2(T_wish))){
+                best_T = T;
+            }
+        }
+    }
+    assert(best_T != -1);
+    return best_T;
+}
+
+// Tables with at most this number of items are PQFlatTable by default
+static const long long FLAT_MAX_N = 1 << 14;
+
+std::shared_ptr<I_PQTable> PQTable::CreateTable(const std::vector<PQ::Array> &codewords, std::shared_ptr<const UcharVecs> pq_codes, int T, bool compress)
+{
+    // If T == -1, then the best T is automatically selected. Small tables are simply scanned
     if(T == -1){
-        T = PQMultiTable::OptimalT( (int) codewords.size() * 8, pq_codes.Size());
+        int M = (int) codewords.size();
+        T = (pq_codes->Size() <= FLAT_MAX_N) ? 0 : SupportedT(M, PQMultiTable::OptimalT(M * 8, pq_codes->Size()));
     }
 
-    if(T == 1){
-        m_table = (I_PQTable *) new PQSingleTable(codewords, pq_codes);
+    if(T == 0){
+        return std::shared_ptr<I_PQTable>((I_PQTable *) new PQFlatTable(codewords, pq_codes));
+    }else if(T == 1){
+        return std::shared_ptr<I_PQTable>((I_PQTable *) new PQSingleTable(codewords, *pq_codes, compress));
     }else if(1 < T){
-        m_table = (I_PQTable *) new PQMultiTable(codewords, pq_codes, T);
+        return std::shared_ptr<I_PQTable>((I_PQTable *) new PQMultiTable(codewords, pq_codes, T, compress));
     }else{
         std::cerr << "Error: strange T: " << T << " in PQTable construction" << std::endl;
+        exit(1);
     }
 }
 
-PQTable::PQTable(std::string dir_path){
+std::shared_ptr<I_PQTable> PQTable::ReadTable(std::string dir_path, MappedFile::Warmup warmup)
+{
     // Read T
     std::ifstream ifs(dir_path + "/T.txt");
     assert(ifs.is_open());
     int T;
     ifs >> T;
 
-    if(T == 1){
-        m_table = (I_PQTable *) new PQSingleTable(dir_path);
+    if(T == 0){
+        return std::shared_ptr<I_PQTable>((I_PQTable *) new PQFlatTable(dir_path, warmup));
+    }else if(T == 1){
+        return std::shared_ptr<I_PQTable>((I_PQTable *) new PQSingleTable(dir_path, warmup));
     }else if(1 < T){
-        m_table = (I_PQTable *) new PQMultiTable(dir_path);
+        return std::shared_ptr<I_PQTable>((I_PQTable *) new PQMultiTable(dir_path, warmup));
     }else{
         std::cerr << "Error: strange T: " << T << " in PQTable construction" << std::endl;
+        exit(1);
     }
 }
 
+PQTable::PQTable(const std::vector<PQ::Array> &codewords, const UcharVecs &pq_codes, int T, bool compress)
+    : m_codewords(codewords), m_compress(compress), m_compactionRatio(0.1), m_compacting(false)
+{
+    std::shared_ptr<Segment> base(new Segment);
+    base->table = CreateTable(codewords, std::shared_ptr<const UcharVecs>(new UcharVecs(pq_codes)), T, compress);
+    base->offset = 0;
+    base->size = pq_codes.Size();
+
+    std::shared_ptr<Snapshot> snapshot(new Snapshot);
+    snapshot->segments.push_back(base);
+    snapshot->size = base->size;
+    m_snapshot = snapshot;
+}
+
+PQTable::PQTable(std::string dir_path, MappedFile::Warmup warmup)
+    : m_codewords(PQ::ReadCodewords(dir_path + "/codeword.txt")), m_compress(false), m_compactionRatio(0.1), m_compacting(false)
+{
+    std::shared_ptr<Snapshot> snapshot(new Snapshot);
+    snapshot->size = 0;
+
+    std::shared_ptr<Segment> base(new Segment);
+    base->table = ReadTable(dir_path, warmup);
+    base->offset = 0;
+    base->size = base->table->Size();
+    m_compress = base->table->IsCompressed();
+    snapshot->segments.push_back(base);
+    snapshot->size += base->size;
+
+    // Added segments, if any
+    std::ifstream ifs(dir_path + "/delta.txt");
+    int num_deltas = 0;
+    if(ifs.is_open()){
+        ifs >> num_deltas;
+    }
+    for(int i = 0; i < num_deltas; ++i){
+        std::string delta_path = dir_path + "/delta" + std::to_string(i);
+        std::shared_ptr<Segment> delta(new Segment);
+        delta->table = ReadTable(delta_path, warmup);
+        delta->offset = snapshot->size;
+        delta->size = delta->table->Size();
+        snapshot->segments.push_back(delta);
+        snapshot->size += delta->size;
+    }
+    m_snapshot = snapshot;
+}
+
 PQTable::~PQTable(){
-    delete m_table;
+    if(m_compactThread.joinable()){
+        m_compactThread.join();
+    }
 }
 
-std::pair<int, float> PQTable::Query(const std::vector<float> &query){
-    return m_table->Query(query);
+std::shared_ptr<const PQTable::Snapshot> PQTable::GetSnapshot() const {
+    return std::atomic_load(&m_snapshot);
 }
 
-std::vector<std::pair<int, float> > PQTable::Query(const std::vector<float> &query, int top_k) {
-    return m_table->Query(query, top_k);
+std::pair<int, float> PQTable::Query(const std::vector<float> &query) const {
+    return Top1(Query(query, 1));
+}
+
+std::vector<std::pair<int, float> > PQTable::Query(const std::vector<float> &query, int top_k) const {
+    return Query(query, top_k, SearchParams(), NULL, NULL);
+}
+
+std::vector<std::pair<int, float> > PQTable::Query(const std::vector<float> &query, int top_k,
+                                                   const SearchParams &params, bool *is_exact, SearchStats *stats) const {
+    assert((int) query.size() == (int) m_codewords.size() * (int) m_codewords[0][0].size());
+    std::vector<std::pair<int, float> > scores;
+    Query(&ThreadLocalContext(), query.data(), top_k, &scores, params, is_exact, stats);
+    return scores;
+}
+
+void PQTable::Query(QueryContext *ctx, const float *query, int top_k,
+                    std::vector<std::pair<int, float> > *scores,
+                    const SearchParams &params, bool *is_exact, SearchStats *stats) const {
+    assert(ctx != NULL && scores != NULL);
+    std::shared_ptr<const Snapshot> snapshot = GetSnapshot(); // Kept alive until the search finishes
+    const std::vector<std::shared_ptr<const Segment> > &segments = snapshot->segments;
+    if(segments.size() == 1){ // Only the base one. Ids are the same
+        segments[0]->table->Query(ctx, query, top_k, scores, params, is_exact, stats);
+        return;
+    }
+
+    // Search each segment with the rest of the limits, and merge the results
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    SearchStats total;
+    bool exact = true;
+    TopK &merged = ctx->m_mergeTopK;
+    merged.Reset(top_k);
+    for(const auto &segment : segments){
+        SearchParams rest = params;
+        if(0 <= params.max_keys){
+            rest.max_keys = std::max(0LL, params.max_keys - total.num_probes);
+        }
+        if(0 <= params.max_verified){
+            rest.max_verified = std::max(0LL, params.max_verified - total.num_verified);
+        }
+        if(0 <= params.max_msec){
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            rest.max_msec = std::max(0.0, params.max_msec - elapsed.count());
+        }
+        bool segment_exact;
+        segment->table->Query(ctx, query, top_k, &ctx->m_segmentScores, rest, &segment_exact, &total);
+        exact = exact && segment_exact;
+        for(const auto &score : ctx->m_segmentScores){
+            if(!merged.Push((int) (segment->offset + score.first), score.second)){
+                break; // Scores are sorted. The rest cannot enter either
+            }
+        }
+    }
+    merged.Sorted(scores);
+
+    if(is_exact != NULL){
+        *is_exact = exact;
+    }
+    if(stats != NULL){
+        stats->num_probes += total.num_probes;
+        stats->num_verified += total.num_verified;
+    }
+}
+
+std::vector<std::vector<std::pair<int, float> > > PQTable::QueryBatch(const cv::Mat &queries, int top_k, int num_threads) const {
+    assert(queries.type() == CV_32FC1);
+    assert(queries.cols == (int) m_codewords.size() * (int) m_codewords[0][0].size());
+    assert(0 < top_k);
+
+    std::vector<std::vector<std::pair<int, float> > > scores(queries.rows);
+    ParallelForWorkStealing(queries.rows, [&](int q){
+        Query(&ThreadLocalContext(), queries.ptr<float>(q), top_k, &scores[q]);
+    }, num_threads);
+    return scores;
+}
+
+std::vector<std::vector<std::pair<int, float> > > PQTable::QueryBatch(const std::vector<std::vector<float> > &queries, int top_k, int num_threads) const {
+    assert(!queries.empty());
+    return QueryBatch(PQ::ArrayToMat(queries), top_k, num_threads);
+}
+
+void PQTable::Add(const UcharVecs &pq_codes)
+{
+    assert(pq_codes.Dim() == (int) m_codewords.size());
+    if(pq_codes.Size() == 0){
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_addMutex); // One writer at a time. Searches are not blocked
+
+    std::shared_ptr<const Snapshot> current = GetSnapshot();
+    std::vector<std::shared_ptr<const Segment> > segments = current->segments;
+
+    // Merge the last added segments while they are not much larger than the new one, like a
+    // binary counter. Then segment sizes decrease geometrically, there are O(log N) segments,
+    // and each code is rebuilt O(log N) times in total. The base segment is never merged
+    std::vector<std::shared_ptr<const Segment> > merged; // In the descending order of offset
+    long long size = pq_codes.Size();
+    while(2 <= (int) segments.size() && segments.back()->size <= 2 * size){
+        size += segments.back()->size;
+        merged.push_back(segments.back());
+        segments.pop_back();
+    }
+
+    // The codes of the new segment are concatenated once, and shared with its table
+    const int M = pq_codes.Dim();
+    std::shared_ptr<UcharVecs> codes(new UcharVecs((int) size, M));
+    uchar *dst = codes->MutableRawDataPtr();
+    for(auto it = merged.rbegin(); it != merged.rend(); ++it){
+        std::shared_ptr<const UcharVecs> src = (*it)->table->Codes();
+        std::memcpy(dst, src->RawDataPtr(), (size_t) (*it)->size * M);
+        dst += (size_t) (*it)->size * M;
+    }
+    std::memcpy(dst, pq_codes.RawDataPtr(), (size_t) pq_codes.Size() * M);
+
+    std::shared_ptr<Segment> added(new Segment);
+    added->offset = merged.empty() ? current->size : merged.back()->offset;
+    added->size = size;
+    added->table = CreateTable(m_codewords, codes, -1, m_compress); // Bulk-load in parallel
+
+    // Removed ids of the merged segments are removed from the new one too.
+    // Remove() waits for this function, so no removal is lost
+    for(const auto &segment : merged){
+        if(segment->table->NumRemoved() == 0){
+            continue;
+        }
+        for(long long id = 0; id < segment->size; ++id){
+            if(segment->table->IsRemoved((int) id)){
+                added->table->Remove((int) (segment->offset - added->offset + id));
+            }
+        }
+    }
+    segments.push_back(added);
+
+    // Publish
+    std::shared_ptr<Snapshot> next(new Snapshot);
+    next->segments = segments;
+    next->size = current->size + pq_codes.Size();
+    std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>(next));
+
+    CompactIfNeeded(segments.back());
+}
+
+void PQTable::Remove(long long id)
+{
+    std::lock_guard<std::mutex> lock(m_addMutex); // Segments are not replaced meanwhile
+    std::shared_ptr<const Snapshot> current = GetSnapshot();
+    assert(0 <= id && id < current->size);
+
+    // The segment containing id. Segments are in the order of offset
+    const std::vector<std::shared_ptr<const Segment> > &segments = current->segments;
+    int s = (int) segments.size() - 1;
+    while(id < segments[s]->offset){
+        --s;
+    }
+    segments[s]->table->Remove((int) (id - segments[s]->offset)); // Searches skip it from now on
+
+    CompactIfNeeded(segments[s]);
+}
+
+void PQTable::CompactIfNeeded(const std::shared_ptr<const Segment> &segment)
+{
+    if(m_compacting || segment->table->NumStale() <= m_compactionRatio * segment->size){
+        return;
+    }
+    if(m_compactThread.joinable()){
+        m_compactThread.join(); // The last compaction has finished (it does not hold the lock any more)
+    }
+    m_compacting = true;
+    m_compactThread = std::thread(&PQTable::Compact, this, segment);
+}
+
+void PQTable::Compact(std::shared_ptr<const Segment> segment)
+{
+    // Build the new table without the lock, so searches, Add(), and Remove() are not blocked.
+    // The tombstones are shared, so ids removed meanwhile are removed from the new table too
+    std::shared_ptr<I_PQTable> table = segment->table->Compacted();
+    {
+        std::lock_guard<std::mutex> lock(m_addMutex);
+        std::shared_ptr<const Snapshot> current = GetSnapshot();
+        std::vector<std::shared_ptr<const Segment> > segments = current->segments;
+        for(auto &s : segments){
+            if(s == segment){ // Not merged by Add() meanwhile
+                std::shared_ptr<Segment> compacted(new Segment(*segment));
+                compacted->table = table;
+                s = compacted;
+
+                std::shared_ptr<Snapshot> next(new Snapshot);
+                next->segments = segments;
+                next->size = current->size;
+                std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>(next));
+                break;
+            }
+        }
+    }
+    m_compacting = false;
+}
+
+long long PQTable::Size() const {
+    return GetSnapshot()->size;
+}
+
+long long PQTable::NumRemoved() const {
+    long long num_removed = 0;
+    for(const auto &segment : GetSnapshot()->segments){
+        num_removed += segment->table->NumRemoved();
+    }
+    return num_removed;
+}
+
+int PQTable::NumSegments() const {
+    return (int) GetSnapshot()->segments.size();
 }
 
 void PQTable::Write(std::string dir_path) {
-    m_table->Write(dir_path);
+    std::lock_guard<std::mutex> lock(m_addMutex); // Tables are written with their removed ids
+    std::shared_ptr<const Snapshot> snapshot = GetSnapshot();
+    snapshot->segments[0]->table->Write(dir_path);
+
+    // Added segments
+    int num_deltas = (int) snapshot->segments.size() - 1;
+    for(int i = 0; i < num_deltas; ++i){
+        snapshot->segments[i + 1]->table->Write(dir_path + "/delta" + std::to_string(i));
+    }
+    std::ofstream ofs(dir_path + "/delta.txt");
+    assert(ofs.is_open());
+    ofs << num_deltas;
 }
 
 
@@ -17,9 +17,15 @@
 //
 //   /* PQTable is instantiated with the codewords and the PQ-codes. */
 //   /* The best "T" is selected automaticallly. If T=1, the sinle-PQTable is
-//   /* created. Otherwise, multi-PQTable is created.
+//   /* created. Otherwise, multi-PQTable is created. For small N (or if T=0),
+//   /* the codes are simply scanned (PQFlatTable), which is faster than hashing there.
+//   /* With 4-bit codes (PQ::Learn(train_vecs, M, 16)), the scan is several times faster.
 //   pqtable::PQTable tbl(pq.GetCodewords(), codes);
 //
+//   /* Or, the posting lists of the hash tables can be compressed, which takes about */
+//   /* half the memory and the disk space, at about the same search speed. */
+//   pqtable::PQTable tbl_compressed(pq.GetCodewords(), codes, -1, true);
+//
 //   /* Neareset neighbor search for 0-th query vector. */
 //   /* score.first is the nearest-id. score.second is the distance between */
 //   /* the 0-th query and the nearest-id-th base vec. */
@@ -29,27 +35,182 @@
 //   /* scores[0] is the nearest result, and scores[1] is the second nearest result. */
 //   int top_k = 3;
 //   vector<pair<int, float>> scores = tbl.Query(query_vecs[0], top_k);
+//
+//   /* Or, you can limit the cost of a search. The best results found within */
+//   /* 0.5 msec are returned, and is_exact tells whether they are the exact top-k. */
+//   pqtable::SearchParams params;
+//   params.max_msec = 0.5;
+//   bool is_exact;
+//   scores = tbl.Query(query_vecs[0], top_k, params, &is_exact);
+//
+//   /* Or, you can search all queries at once using all cores. */
+//   /* batch_scores[q] is the top-k result of the q-th query. */
+//   vector<vector<pair<int, float>>> batch_scores = tbl.QueryBatch(query_vecs, top_k);
+//
+//   /* Several threads can share one table. Each thread keeps its own context, */
+//   /* and the search allocates nothing once the context has grown. */
+//   pqtable::QueryContext ctx;
+//   tbl.Query(&ctx, query_vecs[0].data(), top_k, &scores);
+//
+//   /* New codes can be added while other threads are searching. */
+//   /* Their ids follow the existing ones. */
+//   tbl.Add(pq.Encode(new_vecs));
+//
+//   /* Items can be removed. They never appear in the results */
+//   tbl.Remove(some_id);
+//
+//   /* Tables can be saved, and opened later by mmap (zero-copy) */
+//   tbl.Write("some_dir");
+//   pqtable::PQTable tbl2("some_dir");
 
 #include <opencv2/opencv.hpp>
 #include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
 
 #include "pq.h"
 #include "code_to_key.h"
 #include "pq_key_generator.h"
+#include "candidate_counter.h"
+#include "top_k.h"
+#include "tombstones.h"
+#include "work_stealing.h"
+#include "mapped_file.h"
 #include "sparse_hashtable/sparse_hashtable.h"
+#include "sparse_hashtable/frozen_sparse_hashtable.h"
 #include "sparse_hashtable/helper_sht.h"
 
 
 namespace pqtable {
 
+class BudgetChecker; // See pq_table.cpp
+
+// Counters of the work done by searches
+struct SearchStats{
+    SearchStats() : num_probes(0), num_verified(0) {}
+    long long num_probes;    // The number of hash table lookups (blocks scanned, for PQFlatTable)
+    long long num_verified;  // The number of items whose AD is computed (found items, for a single table)
+};
+
+// Per-query limits. A search stops when any limit is reached, and returns the best results
+// found so far (possibly less than top_k). -1 means no limit.
+// The limits are checked before each hash table lookup, so max_verified can be exceeded
+// by the items in one bucket, and max_msec by the time of 16 lookups.
+// PQFlatTable counts a block of 32 items as a lookup, and checks the limits every 32 blocks
+//
+// scan_ratio is not a limit. When the work of a search (lookups + items verified) exceeds scan_ratio *
+// (the cost of a linear scan), the keys are so far that the scan is cheaper, and the search switches to it.
+// The results are the same (up to ties). -1 means never. Used only without limits. The scan is
+//  - PQMultiTable : the ADs of all N codes, gathered from the codes by AsymDists. The blocked fast-scan
+//                   layout of PQFlatTable is not built for this, since it would double the memory of the codes
+//  - PQSingleTable: the non-empty buckets (whose key is the code itself). The cost is the number of them
+//                   plus that of bucket groups (2^(8M) / 32), which are read to find them
+//
+// scan_threads is the number of threads that scan a large PQFlatTable for one query (-1: all cores).
+// Default: 1, since the caller usually runs a query per core already (e.g., QueryBatch, or a server thread
+// per request). Set it only when the cores are idle otherwise, e.g., for a single query stream
+//
+// schedule overrides the order in which a PQMultiTable probes its tables (PQMultiTable::Schedule) for
+// a query, e.g., to compare them through PQTable. -1 means the table's one (PQMultiTable::SetSchedule())
+struct SearchParams{
+    SearchParams() : max_keys(-1), max_verified(-1), max_msec(-1), scan_ratio(0.2), scan_threads(1), schedule(-1) {}
+    long long max_keys;      // The number of keys popped, i.e., hash table lookups
+    long long max_verified;  // The number of items verified (see SearchStats::num_verified)
+    double max_msec;         // Wall-clock time in milliseconds
+    double scan_ratio;       // Default: 0.2
+    int scan_threads;        // Default: 1
+    int schedule;            // Default: -1
+};
+
+// Scratch memory for searches: a distance table, key generators, a candidate counter,
+// and a top-k heap. Searches with a context allocate nothing once the context has grown
+// to the size a query needs. A context must not be used by two searches at the same time,
+// so give each thread its own one. A context can be used for any table.
+//
+// Usage:
+//   pqtable::QueryContext ctx;    /* e.g., one per server thread */
+//   std::vector<std::pair<int, float> > scores;
+//   tbl.Query(&ctx, query.data(), top_k, &scores);   /* const. Safe to call concurrently */
+class QueryContext{
+public:
+    QueryContext() {}
+
+private:
+    friend class PQSingleTable;
+    friend class PQMultiTable;
+    friend class PQFlatTable;
+    friend class PQTable;
+
+    std::vector<float> m_dtable;               // [m * Ks + ks]
+    std::vector<PQKeyGenerator> m_keyGens;     // [t]
+    CandidateCounter m_counter;
+    TopK m_topk;
+    std::vector<float> m_nextDist;             // [t]
+    std::vector<float> m_gain;                 // [t]
+    std::vector<std::pair<int, float> > m_segmentScores;  // Results of a segment of PQTable
+    TopK m_mergeTopK;                          // Merges the results of segments
+    std::vector<uint> m_postings;              // Ids of a bucket decoded from a compressed table
+    std::vector<uint> m_newIds;                // Ids found for the first time in a bucket
+    std::vector<float> m_newDists;             // Their ADs
+    std::vector<uchar> m_luts;                 // Quantized distance table of PQFlatTable
+    std::vector<TopK> m_scanTopKs;             // [thread]. Top-ks of a parallel scan of PQFlatTable
+    std::vector<std::pair<int, float> > m_scanScores; // To merge them
+};
+
 class I_PQTable // interface. abstract basic class.
 {
 public:
     virtual ~I_PQTable() {}
 
-    virtual std::pair<int, float> Query(const std::vector<float> &query) = 0;   // for top-1 search
-    virtual std::vector<std::pair<int, float> > Query(const std::vector<float> &query, int top_k) = 0;  // for top-k search
+    // Reentrant top-k search. query is a D-dim array. Results are written to *scores in the ascending
+    // order of distance (less than top_k if a limit of params is reached or top_k > the number of items).
+    // *is_exact is set false if the search is stopped by a limit. is_exact and stats can be NULL.
+    // stats are accumulated. The table is not modified, so this can be called concurrently
+    // by several threads, each with its own ctx
+    virtual void Query(QueryContext *ctx, const float *query, int top_k,
+                       std::vector<std::pair<int, float> > *scores,
+                       const SearchParams &params = SearchParams(),
+                       bool *is_exact = NULL, SearchStats *stats = NULL) const = 0;
+
+    // The same as above, with a context for each thread (kept by the library)
+    std::pair<int, float> Query(const std::vector<float> &query) const;   // for top-1 search
+    std::vector<std::pair<int, float> > Query(const std::vector<float> &query, int top_k) const;  // for top-k search
+    std::vector<std::pair<int, float> > Query(const std::vector<float> &query, int top_k,
+                                              const SearchParams &params,
+                                              bool *is_exact, SearchStats *stats = NULL) const; // with limits
+
+    // Search for several queries in parallel. queries is a CV_32FC1 matrix (a query per row).
+    // The queries are distributed over threads by work stealing (see work_stealing.h).
+    // If num_threads == -1, all cores are used.
+    virtual std::vector<std::vector<std::pair<int, float> > > QueryBatch(const cv::Mat &queries, int top_k,
+                                                                         int num_threads = -1) const;
     virtual void Write(std::string dir_path) = 0;
+    virtual long long Size() const = 0; // The number of items, including removed ones
+
+    // Deletion. A removed id is skipped by searches at once (a tombstone), and is dropped from
+    // the hash tables by Compacted(). The ids of the other items do not change.
+    // Remove() can be called while other threads are searching
+    virtual void Remove(int id) = 0;
+    virtual bool IsRemoved(int id) const = 0;
+    virtual long long NumRemoved() const = 0;
+    virtual long long NumStale() const = 0; // The number of removed ids which are still in the hash tables
+
+    // Whether the posting lists of the hash tables are compressed (see FrozenSparseHashtable::compress())
+    virtual bool IsCompressed() const = 0;
+
+    // The PQ codes ([id]). Shared with the table if it keeps them (PQMultiTable, PQFlatTable). PQSingleTable
+    // does not, and decodes them from its hash table; then the codes of removed ids no longer in it are 0
+    virtual std::shared_ptr<const UcharVecs> Codes() const = 0;
+
+    // A new table whose hash tables do not contain the removed ids, so that probes do not visit them.
+    // The codes and the tombstones are shared with this table, so a Remove() on either is seen by both.
+    // This reads all items once, and can be called while other threads are searching
+    virtual std::shared_ptr<I_PQTable> Compacted() const = 0;
+
+protected:
+    virtual int Dim() const = 0; // The dimension of a query
 };
 
 
@@ -57,24 +218,59 @@ public:
 class PQSingleTable: I_PQTable
 {
 public:
+    // If compress, the posting lists are compressed (smaller, and usually faster for large N)
     PQSingleTable(const std::vector<PQ::Array> &codewords,
-            const UcharVecs &pq_codes);
-    PQSingleTable(std::string dir_path); // Read from saved files (a dir contains files)
-
-    // Querying function.
-    std::pair<int, float> Query(const std::vector<float> &query); // fot top-1
-    std::vector<std::pair<int, float> > Query(const std::vector<float> &query, int top_k); // for top-k        
+            const UcharVecs &pq_codes, bool compress = false);
+    PQSingleTable(std::string dir_path,
+                  MappedFile::Warmup warmup = MappedFile::WARMUP_NONE); // Read from saved files (a dir contains files)
+
+    // Querying function. See I_PQTable
+    void Query(QueryContext *ctx, const float *query, int top_k,
+               std::vector<std::pair<int, float> > *scores,
+               const SearchParams &params = SearchParams(),
+               bool *is_exact = NULL, SearchStats *stats = NULL) const;
+    using I_PQTable::Query;
+    using I_PQTable::QueryBatch;
 
     // IO
     void Write(std::string dir_path);
 
+    long long Size() const {return m_removed->Size();}
+
+    // Deletion. See I_PQTable
+    void Remove(int id) {m_removed->Set(id);}
+    bool IsRemoved(int id) const {return m_removed->Test(id);}
+    long long NumRemoved() const {return m_removed->Count();}
+    long long NumStale() const {return m_removed->Count() - m_numCompacted;}
+    std::shared_ptr<I_PQTable> Compacted() const;
+
+    bool IsCompressed() const {return m_sHashTable.is_compressed();}
+    std::shared_ptr<const UcharVecs> Codes() const;
+
 private:
     PQSingleTable();
+    PQSingleTable(const PQSingleTable &src, bool compact); // Copy src without the removed ids in the hash table
+
+    int Dim() const {return m_PQ.GetM() * m_PQ.GetDs();}
+
+    // The search function is specialized for M at compile time, and selected once
+    // at construction/load
+    void SelectKernels();
+    template<int M> void Search(QueryContext *ctx, const float *query, int top_k,
+                                std::vector<std::pair<int, float> > *scores,
+                                const SearchParams &params, bool *is_exact, SearchStats *stats) const;
+    // The top-k of all buckets, with the distance table in ctx (see SearchParams::scan_ratio)
+    template<int M> void Scan(QueryContext *ctx, int top_k, std::vector<std::pair<int, float> > *scores) const;
+    void (PQSingleTable::*m_search)(QueryContext *, const float *, int, std::vector<std::pair<int, float> > *,
+                                    const SearchParams &, bool *, SearchStats *) const;
 
     PQ m_PQ;
 
-    // Table
-    SparseHashtable m_sHashTable;
+    // Table. Built by SparseHashtable, then frozen into a flat layout
+    FrozenSparseHashtable m_sHashTable;
+
+    std::shared_ptr<Tombstones> m_removed; // [id]. Shared with compacted tables
+    long long m_numCompacted;              // The number of removed ids not in m_sHashTable
 };
 
 
@@ -83,53 +279,219 @@ class PQMultiTable: I_PQTable
 public:
     PQMultiTable(const std::vector<PQ::Array> &codewords,
                  const UcharVecs &pq_codes,
-                 int T);
-    PQMultiTable(std::string dir_path);
-
-    std::pair<int, float> Query(const std::vector<float> &query);
-    std::vector<std::pair<int, float> > Query(const std::vector<float> &query, int top_k);
+                 int T, bool compress = false); // See PQSingleTable for compress
+    PQMultiTable(const std::vector<PQ::Array> &codewords,
+                 std::shared_ptr<const UcharVecs> pq_codes,
+                 int T, bool compress = false); // The same as above. pq_codes are shared, not copied
+    PQMultiTable(std::string dir_path,
+                 MappedFile::Warmup warmup = MappedFile::WARMUP_NONE);
+
+    // Querying function. See I_PQTable.
+    // Tables are probed until the sum of the next key distances (a lower bound of the AD of
+    // any unseen id) exceeds the k-th AD found (threshold algorithm).
+    // So the results are the exact top-k in terms of AD
+    void Query(QueryContext *ctx, const float *query, int top_k,
+               std::vector<std::pair<int, float> > *scores,
+               const SearchParams &params = SearchParams(),
+               bool *is_exact = NULL, SearchStats *stats = NULL) const;
+    using I_PQTable::Query;
+    using I_PQTable::QueryBatch;
+
+    // The order to probe the tables. The results are the same for all; only the amount of work differs.
+    // SCHEDULE_ROUND_ROBIN   : t = 0, 1, ..., T-1, 0, 1, ... (default)
+    // SCHEDULE_NEAREST_FIRST : the table whose next key is the nearest
+    // SCHEDULE_COST_AWARE    : the table that recently raised the bound the most per
+    //                          (lookup + AD computations)
+    // Round-robin is the default since it did the least work (probes and ADs) in pqtable_bench for top_k >= 10.
+    // See examples/demo_siftsmall_schedule.cpp or "pqtable_bench --schedule" to compare them on your data.
+    // Do not call this during searches
+    enum Schedule {SCHEDULE_ROUND_ROBIN, SCHEDULE_NEAREST_FIRST, SCHEDULE_COST_AWARE};
+    void SetSchedule(Schedule schedule) {m_schedule = schedule;}
 
     // IO
     void Write(std::string dir_path);
 
+    long long Size() const {return m_codes->Size();}
+
+    // Deletion. See I_PQTable
+    void Remove(int id) {m_removed->Set(id);}
+    bool IsRemoved(int id) const {return m_removed->Test(id);}
+    long long NumRemoved() const {return m_removed->Count();}
+    long long NumStale() const {return m_removed->Count() - m_numCompacted;}
+    std::shared_ptr<I_PQTable> Compacted() const;
+
+    bool IsCompressed() const {return m_sHashTableEach[0].is_compressed();}
+    std::shared_ptr<const UcharVecs> Codes() const {return m_codes;}
+
     static int OptimalT(int B, int N) {
         return std::pow(2, std::round(std::log2(B / std::log2(N))));
     }
 private:
     PQMultiTable();        
-
+    PQMultiTable(const PQMultiTable &src, bool compact); // Copy src without the removed ids in the hash tables
+
+    int Dim() const {return m_PQ.GetM() * m_PQ.GetDs();}
+
+    // The search function is specialized for M/T (key generation) at compile time, and selected
+    // once at construction/load. ADs are computed in batches by a SIMD kernel (see AsymDists)
+    void SelectKernels();
+    template<int EACH_M> void Search(QueryContext *ctx, const float *query, int top_k,
+                                     std::vector<std::pair<int, float> > *scores,
+                                     const SearchParams &params, bool *is_exact, SearchStats *stats) const;
+    // The top-k of all codes by a linear scan (see SearchParams::scan_ratio). topk is reset
+    void Scan(QueryContext *ctx, const float *dtable, int top_k, TopK *topk) const;
+    void (PQMultiTable::*m_search)(QueryContext *, const float *, int, std::vector<std::pair<int, float> > *,
+                                   const SearchParams &, bool *, SearchStats *) const;
+
+    Schedule m_schedule;
     int m_T;
-    std::vector<std::vector<PQ::Array> > m_codewordsEach; // [t][m][ks][ds]
-    std::vector<SparseHashtable> m_sHashTableEach; // [t]
+    std::vector<FrozenSparseHashtable> m_sHashTableEach; // [t]
 
     PQ m_PQ;
-    UcharVecs m_codes; // PQ code itself
+    std::shared_ptr<const UcharVecs> m_codes; // PQ code itself. Shared with compacted tables
+
+    std::shared_ptr<Tombstones> m_removed; // [id]. Shared with compacted tables
+    long long m_numCompacted;              // The number of removed ids not in m_sHashTableEach
+};
+
+
+
+
+// Exhaustive search. The ADs of all items are computed by a linear scan, which is faster than
+// hashing for small N (PQTable uses this for small tables; see PQTable::CreateTable).
+// The codes are stored in a blocked layout (see AsymDistsBlocked in distance.h):
+//  - If Ks <= 16, two 4-bit elements are packed into a byte. Lower bounds of the ADs are computed from
+//    an 8-bit quantized distance table by shuffles (fast scan), and only the items whose lower bound
+//    can enter the top-k are verified by the exact AD
+//  - Otherwise, the ADs are computed by gathers
+// Either way, the results are the exact top-k in terms of AD, as with the other tables.
+// The blocked layout is used only by this table, i.e., for T = 0, or for N <= 2^14 with T = -1.
+// The scan fallback of the hash tables does not use it (see SearchParams::scan_ratio).
+// A large table can be scanned by several threads for a query (see SearchParams::scan_threads)
+class PQFlatTable: I_PQTable
+{
+public:
+    PQFlatTable(const std::vector<PQ::Array> &codewords,
+                const UcharVecs &pq_codes);
+    PQFlatTable(const std::vector<PQ::Array> &codewords,
+                std::shared_ptr<const UcharVecs> pq_codes); // The same as above. pq_codes are shared, not copied
+    PQFlatTable(std::string dir_path,
+                MappedFile::Warmup warmup = MappedFile::WARMUP_NONE);
+
+    // Querying function. See I_PQTable. A scan stopped by a limit of params returns the best of
+    // the items scanned so far
+    void Query(QueryContext *ctx, const float *query, int top_k,
+               std::vector<std::pair<int, float> > *scores,
+               const SearchParams &params = SearchParams(),
+               bool *is_exact = NULL, SearchStats *stats = NULL) const;
+    using I_PQTable::Query;
+    using I_PQTable::QueryBatch;
+
+    // IO
+    void Write(std::string dir_path);
+
+    long long Size() const {return m_codes->Size();}
+
+    // Deletion. See I_PQTable. Removed ids are skipped by the scan, and there is nothing to compact
+    void Remove(int id) {m_removed->Set(id);}
+    bool IsRemoved(int id) const {return m_removed->Test(id);}
+    long long NumRemoved() const {return m_removed->Count();}
+    long long NumStale() const {return 0;}
+    std::shared_ptr<I_PQTable> Compacted() const;
+
+    bool IsCompressed() const {return false;}
+    std::shared_ptr<const UcharVecs> Codes() const {return m_codes;}
 
-    // Helper function. Divide codewords into codewords_each
-    void DivideCodewords(const std::vector<PQ::Array> &codewords,
-                         int T,
-                         std::vector<std::vector<PQ::Array> > *codewords_each);
+private:
+    PQFlatTable();
+
+    int Dim() const {return m_PQ.GetM() * m_PQ.GetDs();}
+
+    bool IsFastScan() const {return m_PQ.GetKs() <= 16;}
+    void BuildBlocks(); // m_blocks from m_codes
+
+    // Scan the blocks [b_begin, b_end), and push the live items to topk. Returns the end of the
+    // blocks scanned, which is less than b_end if a limit of budget is reached.
+    // For the fast scan, luts are the quantized tables, and bias + delta * (the sum of them) <= AD
+    long long ScanBlocks(const float *dtable, const uchar *luts, float bias, float delta,
+                         long long b_begin, long long b_end, BudgetChecker *budget, TopK *topk) const;
+
+    PQ m_PQ;
+    std::shared_ptr<const UcharVecs> m_codes; // PQ codes (row-major). Used to verify the fast scan and to write
+    std::shared_ptr<const std::vector<uchar, AlignedAllocator<uchar> > > m_blocks; // Blocked layout
+    std::shared_ptr<Tombstones> m_removed; // [id]
 };
 
 
 
 
-// Proxy class. This class can automatically select the best table either from singletable or multitable
+// Proxy class. This class can automatically select the best table either from singletable or multitable.
+//
+// New codes can be added while other threads are searching. An index is a list of segments:
+// the first (base) one is built at construction, and each Add() appends a segment whose ids follow
+// the existing ones. Small segments are merged into larger ones so that there are O(log N) of them.
+// The list is an immutable snapshot that is replaced atomically, so a search sees either all or none
+// of an Add(), and segments are freed only after the last search using them finishes.
+//
+// Removed ids are skipped at once. When the removed ids still in the hash tables of a segment exceed
+// a ratio of it (see SetCompactionRatio()), a background thread builds the segment again without them
+// and swaps it in, so the cost of searches and the memory of the tables do not grow with deletions.
 class PQTable{
 public:
+    // If T == -1, then the best T is automatically selected (T = 0, a PQFlatTable, for small N).
+    // If compress, the posting lists of the tables (also of the added segments) are compressed
     PQTable(const std::vector<PQ::Array> &codewords,
             const UcharVecs &pq_codes,
-            int T = -1); // If T == -1, then the best T is automatically selected
+            int T = -1, bool compress = false);
 
-    PQTable(std::string dir_path); // Read from the saved dir
+    // Read from the saved dir. The tables and the codes are memory-mapped and used
+    // in place, so opening is fast and the memory is shared among processes.
+    // Set warmup to pre-load the pages (see mapped_file.h).
+    PQTable(std::string dir_path,
+            MappedFile::Warmup warmup = MappedFile::WARMUP_NONE);
 
     ~PQTable();
 
 
-    std::pair<int, float> Query(const std::vector<float> &query);
-    std::vector<std::pair<int, float> > Query(const std::vector<float> &query, int top_k);
+    std::pair<int, float> Query(const std::vector<float> &query) const;
+    std::vector<std::pair<int, float> > Query(const std::vector<float> &query, int top_k) const;
 
-    // IO
+    // Search with per-query limits (see SearchParams). Returns the best results found
+    // before a limit is reached, and *is_exact tells whether they are the exact top-k
+    std::vector<std::pair<int, float> > Query(const std::vector<float> &query, int top_k,
+                                              const SearchParams &params,
+                                              bool *is_exact, SearchStats *stats = NULL) const;
+
+    // Reentrant search with a caller-owned context (see QueryContext). No allocation
+    // once ctx and scores have grown. Safe to call concurrently with different contexts
+    void Query(QueryContext *ctx, const float *query, int top_k,
+               std::vector<std::pair<int, float> > *scores,
+               const SearchParams &params = SearchParams(),
+               bool *is_exact = NULL, SearchStats *stats = NULL) const;
+
+    // Batch search. The result [q] is the top-k result of the q-th query
+    std::vector<std::vector<std::pair<int, float> > > QueryBatch(const cv::Mat &queries, int top_k,
+                                                                 int num_threads = -1) const;  // a query per row
+    std::vector<std::vector<std::pair<int, float> > > QueryBatch(const std::vector<std::vector<float> > &queries, int top_k,
+                                                                 int num_threads = -1) const;
+
+    // Add codes. Their ids are Size(), Size() + 1, ... (Size() before the call).
+    // Can be called while other threads are searching. Concurrent Add() calls are serialized
+    void Add(const UcharVecs &pq_codes);
+
+    // Remove the item of id. Its id is not reused, and the ids of the others do not change.
+    // Can be called while other threads are searching. Waits for a running Add()
+    void Remove(long long id);
+
+    // A segment is compacted in the background when its removed ids still in the hash tables
+    // exceed ratio * (the number of items of the segment). Default: 0.1
+    void SetCompactionRatio(double ratio) {m_compactionRatio = ratio;}
+
+    long long Size() const; // The number of items, including removed ones
+    long long NumRemoved() const;
+    int NumSegments() const;
+
+    // IO. Added segments are written to sub dirs (dir_path/delta0, delta1, ...)
     void Write(std::string dir_path);
 
 private:
@@ -137,7 +499,36 @@ private:
     PQTable(const PQTable &);     // In current implementation, copy is prohibited
     const PQTable &operator =(const PQTable &);      // In current implementation, copy is prohibited
 
-    I_PQTable *m_table;
+    struct Segment{
+        std::shared_ptr<I_PQTable> table;   // Its codes (I_PQTable::Codes()) are used to merge segments
+        long long offset;   // The id of the first item
+        long long size;     // The number of items
+    };
+    struct Snapshot{
+        std::vector<std::shared_ptr<const Segment> > segments;  // [0] is the base one
+        long long size;
+    };
+
+    // Build a table with T (-1: auto, 0: PQFlatTable) from codes. pq_codes are shared with the table if it keeps them
+    static std::shared_ptr<I_PQTable> CreateTable(const std::vector<PQ::Array> &codewords,
+                                                  std::shared_ptr<const UcharVecs> pq_codes, int T, bool compress);
+    static std::shared_ptr<I_PQTable> ReadTable(std::string dir_path, MappedFile::Warmup warmup);
+
+    std::shared_ptr<const Snapshot> GetSnapshot() const;  // Use this to read m_snapshot
+
+    // Start compacting segment in the background if it has many removed ids and no compaction
+    // is running. Call this with m_addMutex locked
+    void CompactIfNeeded(const std::shared_ptr<const Segment> &segment);
+    void Compact(std::shared_ptr<const Segment> segment); // Run by m_compactThread
+
+    std::vector<PQ::Array> m_codewords;
+    bool m_compress;                              // For the tables of added segments
+    std::shared_ptr<const Snapshot> m_snapshot;   // Read/written by std::atomic_load/store
+    std::mutex m_addMutex;                        // Serializes Add(), Remove(), Write(), and compactions
+
+    double m_compactionRatio;
+    std::thread m_compactThread;
+    std::atomic<bool> m_compacting;
 };
 
 }
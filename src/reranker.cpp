@@ -0,0 +1,81 @@
+#include "reranker.h"
+#include "distance.h"
+#include "work_stealing.h"
+#include "pq.h"
+
+namespace pqtable {
+
+Reranker::Reranker(std::string filename, std::string ext, MappedFile::Warmup warmup, bool advise_pages)
+    : m_base(filename, ext, warmup), m_advisePages(advise_pages)
+{
+    if(ext != "fvecs" && ext != "bvecs"){
+        std::cerr << "Error: ext must be fvecs or bvecs in Reranker. ext: " << ext << std::endl;
+        exit(1);
+    }
+}
+
+void Reranker::Rerank(const float *query, const std::vector<std::pair<int, float> > &shortlist, int top_k,
+                      std::vector<std::pair<int, float> > *scores) const
+{
+    assert(query != NULL && scores != NULL);
+    assert(0 < top_k);
+    int n = (int) shortlist.size();
+
+    if(m_advisePages){
+        for(int i = 0; i < n; ++i){
+            m_base.WillNeed(shortlist[i].first);
+        }
+    }
+    for(int i = 0; i < n && i < PREFETCH_AHEAD; ++i){
+        m_base.Prefetch(shortlist[i].first);
+    }
+
+    static thread_local std::vector<float> vec;   // The original vector, converted to float
+    static thread_local TopK topk;
+    vec.resize(m_base.Dim());
+    topk.Reset(top_k);
+    for(int i = 0; i < n; ++i){
+        if(i + PREFETCH_AHEAD < n){
+            m_base.Prefetch(shortlist[i + PREFETCH_AHEAD].first);
+        }
+        int id = shortlist[i].first;
+        m_base.GetFloat(id, vec.data());
+        topk.Push(id, L2Sqr(query, vec.data(), m_base.Dim()));
+    }
+    topk.Sorted(scores);
+}
+
+std::vector<std::pair<int, float> > Reranker::Rerank(const std::vector<float> &query,
+                                                     const std::vector<std::pair<int, float> > &shortlist,
+                                                     int top_k) const
+{
+    assert((int) query.size() == m_base.Dim());
+    std::vector<std::pair<int, float> > scores;
+    Rerank(query.data(), shortlist, top_k, &scores);
+    return scores;
+}
+
+std::vector<std::vector<std::pair<int, float> > > Reranker::RerankBatch(const cv::Mat &queries,
+                                                                        const std::vector<std::vector<std::pair<int, float> > > &shortlists,
+                                                                        int top_k, int num_threads) const
+{
+    assert(queries.type() == CV_32FC1);
+    assert(queries.cols == m_base.Dim());
+    assert(queries.rows == (int) shortlists.size());
+
+    std::vector<std::vector<std::pair<int, float> > > scores(queries.rows);
+    ParallelForWorkStealing(queries.rows, [&](int q){
+        Rerank(queries.ptr<float>(q), shortlists[q], top_k, &scores[q]);
+    }, num_threads);
+    return scores;
+}
+
+std::vector<std::vector<std::pair<int, float> > > Reranker::RerankBatch(const std::vector<std::vector<float> > &queries,
+                                                                        const std::vector<std::vector<std::pair<int, float> > > &shortlists,
+                                                                        int top_k, int num_threads) const
+{
+    assert(!queries.empty());
+    return RerankBatch(PQ::ArrayToMat(queries), shortlists, top_k, num_threads);
+}
+
+}
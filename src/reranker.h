@@ -0,0 +1,68 @@
+#ifndef PQTABLE_RERANKER_H
+#define PQTABLE_RERANKER_H
+
+// Exact re-ranking of search results.
+//
+// The results of PQTable are ranked by PQ distances, which are approximate, so the true
+// nearest neighbor is often not the top-1 but is somewhere in the top-100 or so.
+// Reranker re-scores such a shortlist by the exact squared L2 distances to the original
+// vectors, which are read from a memory-mapped .fvecs/.bvecs file, and keeps the top_k.
+// The vectors of a shortlist are prefetched into the cache a few ahead of the distance
+// computation. If the file does not fit in memory, set advise_pages so that the pages of
+// a shortlist are requested from the disk all at once, instead of one page fault at a time.
+//
+// Usage:
+//   /* The ids of the table must be the indices of the vectors in the file */
+//   pqtable::Reranker reranker("bigann_base.bvecs", "bvecs");
+//   std::vector<std::pair<int, float> > shortlist = tbl.Query(query, 100);
+//   std::vector<std::pair<int, float> > scores = reranker.Rerank(query, shortlist, top_k);
+//
+//   /* Or, for all queries in parallel */
+//   batch_scores = reranker.RerankBatch(queries, tbl.QueryBatch(queries, 100), top_k);
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "utils.h"
+#include "top_k.h"
+
+namespace pqtable {
+
+class Reranker{
+public:
+    // ext must be "fvecs" or "bvecs". See MappedFile for warmup
+    Reranker(std::string filename, std::string ext,
+             MappedFile::Warmup warmup = MappedFile::WARMUP_NONE,
+             bool advise_pages = false);
+
+    // Re-score shortlist (e.g., the result of PQTable::Query) for query (a D-dim array).
+    // Results are written to *scores in the ascending order of the exact squared L2 distance.
+    // Thread-safe
+    void Rerank(const float *query, const std::vector<std::pair<int, float> > &shortlist, int top_k,
+                std::vector<std::pair<int, float> > *scores) const;
+    std::vector<std::pair<int, float> > Rerank(const std::vector<float> &query,
+                                               const std::vector<std::pair<int, float> > &shortlist,
+                                               int top_k) const;
+
+    // shortlists[q] is for the q-th query (a row of queries). Queries are processed in parallel
+    std::vector<std::vector<std::pair<int, float> > > RerankBatch(const cv::Mat &queries,
+                                                                  const std::vector<std::vector<std::pair<int, float> > > &shortlists,
+                                                                  int top_k, int num_threads = -1) const;
+    std::vector<std::vector<std::pair<int, float> > > RerankBatch(const std::vector<std::vector<float> > &queries,
+                                                                  const std::vector<std::vector<std::pair<int, float> > > &shortlists,
+                                                                  int top_k, int num_threads = -1) const;
+
+    const MappedVecs &Base() const {return m_base;}
+
+private:
+    Reranker(); // prohibit default construct
+
+    MappedVecs m_base;
+    bool m_advisePages;
+
+    static const int PREFETCH_AHEAD = 4; // The number of vectors prefetched ahead
+};
+
+}
+
+#endif // PQTABLE_RERANKER_H
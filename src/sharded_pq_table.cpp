@@ -0,0 +1,172 @@
+#include "sharded_pq_table.h"
+#include <queue>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <omp.h>
+
+namespace pqtable {
+
+// A context for each thread. A thread searches one shard at a time
+static QueryContext &ShardContext()
+{
+    static thread_local QueryContext ctx;
+    return ctx;
+}
+
+// Merge the sorted lists [s] into the top_k nearest ones, with ids shifted by offsets[s].
+// A heap holds the head of each list, so this takes O(top_k log S)
+static void MergeTopK(const std::vector<std::vector<std::pair<int, float> > > &lists,
+                      const std::vector<long long> &offsets, int top_k,
+                      std::vector<std::pair<long long, float> > *merged)
+{
+    typedef std::pair<float, int> Head; // (dist, s). Ties are broken by s, so the result is deterministic
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads;
+    std::vector<size_t> pos(lists.size(), 0); // pos[s]: the head of the s-th list
+    for(int s = 0; s < (int) lists.size(); ++s){
+        if(!lists[s].empty()){
+            heads.push(Head(lists[s][0].second, s));
+        }
+    }
+
+    merged->clear();
+    while((int) merged->size() < top_k && !heads.empty()){
+        int s = heads.top().second;
+        heads.pop();
+        merged->push_back(std::pair<long long, float>(offsets[s] + lists[s][pos[s]].first, lists[s][pos[s]].second));
+        if(++pos[s] < lists[s].size()){
+            heads.push(Head(lists[s][pos[s]].second, s));
+        }
+    }
+}
+
+ShardedPQTable::ShardedPQTable(const std::vector<PQ::Array> &codewords, const std::vector<UcharVecs> &codes, int T, bool compress)
+{
+    assert(!codes.empty());
+    int S = (int) codes.size();
+    m_shards.resize(S);
+
+    // If there are enough shards, they are built at once, each with one core (nested parallel
+    // regions run on one thread). Otherwise, one by one, each with all cores
+    #pragma omp parallel for schedule(dynamic, 1) if(omp_get_max_threads() <= S)
+    for(int s = 0; s < S; ++s){
+        m_shards[s].reset(new PQTable(codewords, codes[s], T, compress));
+    }
+    SetOffsets();
+}
+
+ShardedPQTable::ShardedPQTable(std::string dir_path, MappedFile::Warmup warmup)
+{
+    assert(dir_path.substr((int) dir_path.size() - 1) != "/"); // dir_path must be "some_dir". Not "some_dir/"
+    std::ifstream ifs(dir_path + "/shards.txt");
+    if(!ifs.is_open()){
+        std::cerr << "Error: cannot open " << dir_path + "/shards.txt" << std::endl;
+        exit(1);
+    }
+    int S;
+    ifs >> S;
+    assert(0 < S);
+    m_shards.resize(S);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int s = 0; s < S; ++s){
+        m_shards[s].reset(new PQTable(dir_path + "/shard" + std::to_string(s), warmup));
+    }
+    SetOffsets();
+}
+
+void ShardedPQTable::SetOffsets()
+{
+    m_offsets.resize(m_shards.size() + 1);
+    m_offsets[0] = 0;
+    for(int s = 0; s < (int) m_shards.size(); ++s){
+        m_offsets[s + 1] = m_offsets[s] + m_shards[s]->Size();
+    }
+}
+
+std::vector<std::pair<long long, float> > ShardedPQTable::Query(const std::vector<float> &query, int top_k,
+                                                                const SearchParams &params, bool *is_exact,
+                                                                SearchStats *stats, int num_threads) const
+{
+    if(num_threads == -1){
+        num_threads = std::min(NumShards(), omp_get_max_threads());
+    }
+    std::vector<std::pair<long long, float> > scores;
+    Search(query.data(), top_k, params, num_threads, &scores, is_exact, stats);
+    return scores;
+}
+
+std::vector<std::vector<std::pair<long long, float> > > ShardedPQTable::QueryBatch(const cv::Mat &queries, int top_k,
+                                                                                   int num_threads) const
+{
+    assert(queries.type() == CV_32FC1);
+    assert(0 < top_k);
+
+    std::vector<std::vector<std::pair<long long, float> > > scores(queries.rows);
+    ParallelForWorkStealing(queries.rows, [&](int q){
+        Search(queries.ptr<float>(q), top_k, SearchParams(), 1, &scores[q], NULL, NULL);
+    }, num_threads);
+    return scores;
+}
+
+void ShardedPQTable::Search(const float *query, int top_k, const SearchParams &params, int num_threads,
+                            std::vector<std::pair<long long, float> > *scores, bool *is_exact, SearchStats *stats) const
+{
+    assert(query != NULL && scores != NULL);
+    assert(0 < top_k && 0 < num_threads);
+
+    int S = NumShards();
+    std::vector<std::vector<std::pair<int, float> > > shard_scores(S); // Local ids
+    std::vector<char> shard_exact(S, true);
+    std::vector<SearchStats> shard_stats(S);
+    #pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1) if(1 < num_threads)
+    for(int s = 0; s < S; ++s){
+        bool exact;
+        m_shards[s]->Query(&ShardContext(), query, top_k, &shard_scores[s], params, &exact, &shard_stats[s]);
+        shard_exact[s] = exact;
+    }
+
+    MergeTopK(shard_scores, m_offsets, top_k, scores);
+
+    if(is_exact != NULL){
+        *is_exact = std::find(shard_exact.begin(), shard_exact.end(), false) == shard_exact.end();
+    }
+    if(stats != NULL){
+        for(const auto &st : shard_stats){
+            stats->num_probes += st.num_probes;
+            stats->num_verified += st.num_verified;
+        }
+    }
+}
+
+void ShardedPQTable::Remove(long long id)
+{
+    assert(0 <= id && id < Size());
+    int s = (int) (std::upper_bound(m_offsets.begin(), m_offsets.end(), id) - m_offsets.begin()) - 1;
+    m_shards[s]->Remove(id - m_offsets[s]);
+}
+
+void ShardedPQTable::Write(std::string dir_path)
+{
+    assert(dir_path.substr((int) dir_path.size() - 1) != "/"); // dir_path must be "some_dir". Not "some_dir/"
+
+    // This part can be re-written by boost::filesystem.
+    std::string cmd = "mkdir -p " + dir_path;
+    assert(!system(cmd.c_str())); // Create a directory where shards are written
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int s = 0; s < NumShards(); ++s){
+        m_shards[s]->Write(dir_path + "/shard" + std::to_string(s));
+    }
+
+    std::ofstream ofs(dir_path + "/shards.txt");
+    assert(ofs.is_open());
+    ofs << NumShards();
+}
+
+long long ShardedPQTable::Size() const
+{
+    return m_offsets.back();
+}
+
+}
@@ -0,0 +1,78 @@
+#ifndef PQTABLE_SHARDED_PQ_TABLE_H
+#define PQTABLE_SHARDED_PQ_TABLE_H
+
+// An index of S independent PQTables (shards). The s-th shard holds the items whose ids are
+// [Offset(s), Offset(s) + Shard(s).Size()), so ids are long long and the index can hold
+// more than 2^31 items, while each shard keeps int ids and 32-bit posting lists.
+//
+// A query is run on all shards in parallel, and the top-k list of each shard is merged
+// by a k-way merge. So a single query can use S cores. Shards are built, written,
+// and read in parallel.
+//
+// Usage:
+//   std::vector<pqtable::UcharVecs> codes(S);   /* codes[s]: the codes of the s-th shard */
+//   pqtable::ShardedPQTable tbl(pq.GetCodewords(), codes);
+//
+//   /* ids are global: codes[1][0] is codes[0].Size() */
+//   std::vector<std::pair<long long, float> > scores = tbl.Query(query_vecs[0], top_k);
+//
+//   tbl.Write("some_dir");    /* some_dir/shard0, some_dir/shard1, ... */
+//   pqtable::ShardedPQTable tbl2("some_dir");
+
+#include <vector>
+#include <memory>
+
+#include "pq_table.h"
+
+namespace pqtable {
+
+class ShardedPQTable{
+public:
+    // The s-th shard is built from codes[s]. See PQTable for T and compress
+    ShardedPQTable(const std::vector<PQ::Array> &codewords,
+                   const std::vector<UcharVecs> &codes,
+                   int T = -1, bool compress = false);
+    ShardedPQTable(std::string dir_path,
+                   MappedFile::Warmup warmup = MappedFile::WARMUP_NONE); // Read from the saved dir
+
+    // Search all shards in parallel with num_threads threads (-1: as many as shards, up to all cores).
+    // Each shard is searched with params, and *is_exact is true if all shards are exact
+    std::vector<std::pair<long long, float> > Query(const std::vector<float> &query, int top_k,
+                                                    const SearchParams &params = SearchParams(),
+                                                    bool *is_exact = NULL, SearchStats *stats = NULL,
+                                                    int num_threads = -1) const;
+
+    // Batch search. Queries are searched in parallel, and the shards of a query one by one,
+    // which is faster than the above if there are enough queries. The result [q] is for the q-th row
+    std::vector<std::vector<std::pair<long long, float> > > QueryBatch(const cv::Mat &queries, int top_k,
+                                                                       int num_threads = -1) const;
+
+    // Remove the item of (global) id. See PQTable::Remove
+    void Remove(long long id);
+
+    // IO. The s-th shard is written to dir_path/shard{s}
+    void Write(std::string dir_path);
+
+    long long Size() const; // The number of items of all shards
+    int NumShards() const {return (int) m_shards.size();}
+    long long Offset(int s) const {return m_offsets[s];} // The id of the first item of the s-th shard
+    const PQTable &Shard(int s) const {return *m_shards[s];}
+
+private:
+    ShardedPQTable(); // Default construct is prohibited
+    ShardedPQTable(const ShardedPQTable &);     // Copy is prohibited
+    const ShardedPQTable &operator =(const ShardedPQTable &);
+
+    void SetOffsets(); // Compute m_offsets from the sizes of the shards
+
+    // Search the shards with num_threads threads, and merge the results
+    void Search(const float *query, int top_k, const SearchParams &params, int num_threads,
+                std::vector<std::pair<long long, float> > *scores, bool *is_exact, SearchStats *stats) const;
+
+    std::vector<std::unique_ptr<PQTable> > m_shards; // [s]
+    std::vector<long long> m_offsets;                // [s]. m_offsets[S] is the number of all items
+};
+
+}
+
+#endif // PQTABLE_SHARDED_PQ_TABLE_H
@@ -0,0 +1,346 @@
+#include "frozen_sparse_hashtable.h"
+#include <omp.h>
+#include <assert.h>
+#include <algorithm>
+
+// One stable counting-sort pass of (key, id) on the digit (key >> shift) & (bins - 1).
+// If src_ids is NULL, the ids are 0, 1, 2, ...
+static void radix_pass(const UINT32 *src_keys, const UINT32 *src_ids,
+                       UINT32 *dst_keys, UINT32 *dst_ids, UINT64 n,
+                       int shift, UINT32 bins) {
+    int max_threads = omp_get_max_threads();
+    std::vector<UINT64> hist((size_t) max_threads * bins, 0); // [thread][digit]
+
+    #pragma omp parallel
+    {
+        int nt = omp_get_num_threads();
+        int t = omp_get_thread_num();
+        UINT64 begin = n * t / nt;
+        UINT64 end = n * (t + 1) / nt;
+        UINT64 *h = &hist[(size_t) t * bins];
+
+        // (1) count
+        for (UINT64 i = begin; i < end; ++i)
+            h[(src_keys[i] >> shift) & (bins - 1)]++;
+
+        #pragma omp barrier
+        // (2) prefix-sum in the order of (digit, thread) so that the sort is stable
+        #pragma omp single
+        {
+            UINT64 sum = 0;
+            for (UINT32 d = 0; d < bins; ++d) {
+                for (int tt = 0; tt < nt; ++tt) {
+                    UINT64 c = hist[(size_t) tt * bins + d];
+                    hist[(size_t) tt * bins + d] = sum;
+                    sum += c;
+                }
+            }
+        }
+
+        // (3) scatter
+        for (UINT64 i = begin; i < end; ++i) {
+            UINT64 pos = h[(src_keys[i] >> shift) & (bins - 1)]++;
+            dst_keys[pos] = src_keys[i];
+            dst_ids[pos] = src_ids ? src_ids[i] : (UINT32) i;
+        }
+    }
+}
+
+FrozenSparseHashtable::FrozenSparseHashtable() {
+    b = 0;
+    size = 0;
+    n_buckets = 0;
+    n_items = 0;
+    groups = NULL;
+    offsets = NULL;
+    ids = NULL;
+    packed = NULL;
+    n_packed = 0;
+    viewing = false;
+}
+
+FrozenSparseHashtable::FrozenSparseHashtable(const FrozenSparseHashtable &rhs) {
+    *this = rhs;
+}
+
+FrozenSparseHashtable& FrozenSparseHashtable::operator= (const FrozenSparseHashtable &rhs) {
+    if (&rhs != this) {
+        b = rhs.b;
+        size = rhs.size;
+        n_buckets = rhs.n_buckets;
+        n_items = rhs.n_items;
+        own_groups = rhs.own_groups;
+        own_offsets = rhs.own_offsets;
+        own_ids = rhs.own_ids;
+        own_packed = rhs.own_packed;
+        n_packed = rhs.n_packed;
+        viewing = rhs.viewing;
+        view_owner = rhs.view_owner;
+        if (viewing) {  // share the buffer
+            groups = rhs.groups;
+            offsets = rhs.offsets;
+            ids = rhs.ids;
+            packed = rhs.packed;
+        } else {
+            bind_own();
+        }
+    }
+    return *this;
+}
+
+void FrozenSparseHashtable::bind_own() {
+    groups = own_groups.data();
+    offsets = own_offsets.data();
+    if (own_packed.empty()) {
+        ids = own_ids.data();
+        packed = NULL;
+        n_packed = 0;
+    } else {
+        ids = NULL;
+        packed = own_packed.data();
+        n_packed = own_packed.size();
+    }
+}
+
+void FrozenSparseHashtable::freeze(const SparseHashtable &table) {
+    b = table.b;
+    size = table.size;
+    const BucketGroup *src = table.PtrTable();
+
+    // Count #buckets and #items to allocate everything at once
+    n_buckets = 0;
+    n_items = 0;
+    for (UINT64 i = 0; i < size; ++i) {
+        if (src[i].empty) {
+            int totones = popcnt(src[i].empty);
+            n_buckets += totones;
+            n_items += src[i].group->arr[2 + totones];
+        }
+    }
+
+    viewing = false;
+    view_owner.reset();
+    own_groups.assign(size, Group());
+    own_offsets.clear();
+    own_offsets.reserve(n_buckets + 1);
+    own_ids.clear();
+    own_ids.reserve(n_items);
+    own_packed.clear();
+
+    for (UINT64 i = 0; i < size; ++i) {
+        own_groups[i].rank = own_offsets.size();
+        own_groups[i].empty = src[i].empty;
+        if (src[i].empty) {
+            // arr[2 .. 2+totones] : offsets of buckets in the group, arr[2+totones+1 ..] : items
+            const UINT32 *arr = src[i].group->arr;
+            int totones = popcnt(src[i].empty);
+            UINT64 base = own_ids.size();
+            for (int j = 0; j < totones; ++j) {
+                own_offsets.push_back(base + arr[2 + j]);
+            }
+            own_ids.insert(own_ids.end(), arr + 2 + totones + 1, arr + 2 + totones + 1 + arr[2 + totones]);
+        }
+    }
+    own_offsets.push_back(own_ids.size()); // sentinel
+    bind_own();
+}
+
+void FrozenSparseHashtable::view(int _b, UINT64 _size, UINT64 _n_buckets, UINT64 _n_items,
+                                 const Group *_groups, const UINT64 *_offsets, const UINT32 *_ids,
+                                 const std::shared_ptr<const void> &owner) {
+    b = _b;
+    size = _size;
+    n_buckets = _n_buckets;
+    n_items = _n_items;
+    own_groups.clear();
+    own_groups.shrink_to_fit();
+    own_offsets.clear();
+    own_offsets.shrink_to_fit();
+    own_ids.clear();
+    own_ids.shrink_to_fit();
+    own_packed.clear();
+    own_packed.shrink_to_fit();
+    groups = _groups;
+    offsets = _offsets;
+    ids = _ids;
+    packed = NULL;
+    n_packed = 0;
+    viewing = true;
+    view_owner = owner;
+}
+
+void FrozenSparseHashtable::view_packed(int _b, UINT64 _size, UINT64 _n_buckets, UINT64 _n_items, UINT64 _n_packed,
+                                        const Group *_groups, const UINT64 *_offsets, const UINT8 *_packed,
+                                        const std::shared_ptr<const void> &owner) {
+    assert(PACK_PADDING <= _n_packed);
+    view(_b, _size, _n_buckets, _n_items, _groups, _offsets, NULL, owner);
+    packed = _packed;
+    n_packed = _n_packed;
+}
+
+// The number of bytes of a varint
+static int varint_size(UINT32 v) {
+    int n = 1;
+    for (; v >= 0x80; v >>= 7)
+        ++n;
+    return n;
+}
+
+void FrozenSparseHashtable::compress() {
+    if (is_compressed())
+        return;
+
+    // (1) Encode each bucket into a scratch buffer of the thread to find its size, and
+    // (2) encode it again into its final place. Buckets are independent, so both are parallel
+    std::vector<UINT64> sizes(n_buckets + 1, 0);
+    std::vector<UINT8> new_packed;
+    for (int step = 0; step < 2; ++step) {
+        #pragma omp parallel
+        {
+            std::vector<UINT32> bucket;
+            std::vector<UINT8> bytes;
+            #pragma omp for schedule(dynamic, 1024)
+            for (long long rr = 0; rr < (long long) n_buckets; ++rr) {
+                UINT64 r = (UINT64) rr;
+                bucket.assign(ids + offsets[r], ids + offsets[r + 1]);
+                if (!std::is_sorted(bucket.begin(), bucket.end()))
+                    std::sort(bucket.begin(), bucket.end());
+                UINT32 n = (UINT32) bucket.size();
+                UINT32 max_diff = 0;
+                for (UINT32 i = 1; i < n; ++i)
+                    max_diff = std::max(max_diff, bucket[i] - bucket[i - 1]);
+                int w = 0;
+                while (w < 32 && (max_diff >> w) != 0)
+                    ++w;
+
+                UINT64 n_bytes = varint_size(n) + 1 + sizeof(UINT32) + ((UINT64)(n - 1) * w + 7) / 8;
+                if (step == 0) {
+                    sizes[r] = n_bytes;
+                    continue;
+                }
+                bytes.assign(n_bytes + 8, 0); // +8 for the 8-byte writes below
+                UINT8 *p = bytes.data();
+                for (UINT32 v = n; ; v >>= 7) {
+                    *p++ = (UINT8)((v & 0x7f) | (v >= 0x80 ? 0x80 : 0));
+                    if (v < 0x80)
+                        break;
+                }
+                *p++ = (UINT8) w;
+                memcpy(p, &bucket[0], sizeof(UINT32));
+                p += sizeof(UINT32);
+                UINT64 pos = 0;
+                for (UINT32 i = 1; i < n; ++i, pos += w) {
+                    UINT64 word;
+                    memcpy(&word, p + (pos >> 3), sizeof(UINT64));
+                    word |= (UINT64)(bucket[i] - bucket[i - 1]) << (pos & 7);
+                    memcpy(p + (pos >> 3), &word, sizeof(UINT64));
+                }
+                memcpy(&new_packed[sizes[r]], bytes.data(), n_bytes);
+            }
+        }
+        if (step == 0) { // Sizes to positions
+            UINT64 sum = 0;
+            for (UINT64 r = 0; r <= n_buckets; ++r) {
+                UINT64 sz = sizes[r];
+                sizes[r] = sum;
+                sum += sz;
+            }
+            new_packed.assign(sum + PACK_PADDING, 0);
+        }
+    }
+
+    if (viewing)
+        own_groups.assign(groups, groups + size);
+    own_offsets.swap(sizes);
+    own_ids.clear();
+    own_ids.shrink_to_fit();
+    own_packed.swap(new_packed);
+    viewing = false;
+    view_owner.reset();
+    bind_own();
+}
+
+void FrozenSparseHashtable::bulk_load(int _b, const UINT32 *keys, UINT64 n) {
+    assert(5 <= _b && _b <= 32);
+    b = _b;
+    size = UINT64_1 << (b - 5);
+
+    // (1) Sort (key, id) by key. Use digits of at most 11 bits so that histograms stay in L1
+    int n_pass = (b + 10) / 11;
+    int digit_bits = (b + n_pass - 1) / n_pass;
+    std::vector<UINT32> keys_a(n), keys_b, ids_a(n), ids_b;
+    if (1 < n_pass) {
+        keys_b.resize(n);
+        ids_b.resize(n);
+    }
+    radix_pass(keys, NULL, keys_a.data(), ids_a.data(), n, 0, (UINT32) 1 << digit_bits);
+    for (int p = 1; p < n_pass; ++p) {
+        radix_pass(keys_a.data(), ids_a.data(), keys_b.data(), ids_b.data(), n,
+                   digit_bits * p, (UINT32) 1 << digit_bits);
+        keys_a.swap(keys_b);
+        ids_a.swap(ids_b);
+    }
+    keys_b.clear();
+    keys_b.shrink_to_fit();
+    ids_b.clear();
+    ids_b.shrink_to_fit();
+    const UINT32 *sorted = keys_a.data();
+
+    // (2) Find the start of each bucket. Count per thread, then prefix-sum to get the ranks
+    int max_threads = omp_get_max_threads();
+    std::vector<UINT64> n_starts(max_threads + 1, 0);
+    #pragma omp parallel
+    {
+        int nt = omp_get_num_threads();
+        int t = omp_get_thread_num();
+        UINT64 begin = n * t / nt;
+        UINT64 end = n * (t + 1) / nt;
+        UINT64 c = 0;
+        for (UINT64 i = begin; i < end; ++i)
+            if (i == 0 || sorted[i] != sorted[i - 1])
+                c++;
+        n_starts[t + 1] = c;
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            for (int tt = 0; tt < nt; ++tt)
+                n_starts[tt + 1] += n_starts[tt];
+            n_buckets = n_starts[nt];
+            own_offsets.resize(n_buckets + 1);
+            own_offsets[n_buckets] = n; // sentinel
+        }
+
+        UINT64 r = n_starts[t];
+        for (UINT64 i = begin; i < end; ++i)
+            if (i == 0 || sorted[i] != sorted[i - 1])
+                own_offsets[r++] = i;
+    }
+
+    // (3) Set the empty bits and the rank of each group.
+    // The thread that sees the first bucket of group g sets the groups up to g
+    own_groups.assign(size, Group());
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (long long rr = 0; rr < (long long) n_buckets; ++rr) {
+        UINT64 r = (UINT64) rr;
+        UINT64 g = sorted[own_offsets[r]] >> 5;
+        UINT64 g_prev_end = (r == 0) ? 0 : (sorted[own_offsets[r - 1]] >> 5) + 1;
+        if (r != 0 && g < g_prev_end)
+            continue; // Not the first bucket of the group
+        for (UINT64 gg = g_prev_end; gg <= g; ++gg)
+            own_groups[gg].rank = r;
+        for (UINT64 r2 = r; r2 < n_buckets && (sorted[own_offsets[r2]] >> 5) == g; ++r2)
+            own_groups[g].empty |= (UINT32) 1 << (sorted[own_offsets[r2]] % 32);
+    }
+    UINT64 g_end = (n_buckets == 0) ? 0 : (sorted[own_offsets[n_buckets - 1]] >> 5) + 1;
+    for (UINT64 g = g_end; g < size; ++g)
+        own_groups[g].rank = n_buckets;
+
+    // (4) The sorted ids are the items
+    n_items = n;
+    own_ids.swap(ids_a);
+    own_packed.clear();
+    viewing = false;
+    view_owner.reset();
+    bind_own();
+}
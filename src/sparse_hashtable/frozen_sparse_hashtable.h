@@ -0,0 +1,231 @@
+/* Read-only sparse hashtable in a flat (CSR) layout.
+ *
+ * SparseHashtable keeps each group of 32 buckets in its own malloc'd Array32,
+ * so a probe chases table -> Array32* -> arr. Once a table is built, it can be
+ * frozen into three contiguous arrays:
+ *   groups[i]  : "empty" bits of the i-th bucket group, and the rank of its
+ *                first non-empty bucket among all non-empty buckets
+ *   offsets[r] : start position (in ids) of the r-th non-empty bucket.
+ *                offsets[r + 1] - offsets[r] is its size
+ *   ids[]      : all items, bucket by bucket
+ * The query(index, &size) interface is the same as SparseHashtable.
+ *
+ * The arrays are either owned by the table (freeze(), or read from a file), or
+ * point into an external read-only buffer such as a memory-mapped file (view()).
+ * In the latter case, the buffer is kept alive by "owner". See
+ * HelperSparseHashtable for the file format.
+ *
+ * Optionally, the ids can be compressed (compress()). Then each bucket is a byte string
+ *   [the number of ids (varint)] [bit width w (1 byte)] [the first id (4 bytes)]
+ *   [the differences of the following ids, w bits each, packed LSB-first]
+ * in packed[], and offsets[r] is the byte position of the r-th bucket. Ids in a bucket are
+ * ascending, so w is usually much less than 32. Such a bucket is decoded into a buffer of the
+ * caller by query(index, &size, &buf). */
+
+#ifndef FROZEN_SPHASHTABLE_H__
+#define FROZEN_SPHASHTABLE_H__
+
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cassert>
+#include "types.h"
+#include "sparse_hashtable.h"
+
+namespace pqtable { class HelperSparseHashtable; }
+
+class FrozenSparseHashtable {
+
+ public:
+
+    struct Group {
+        UINT64 rank;   // #non-empty buckets before this group
+        UINT32 empty;  // i-th bit is 1 if i-th bucket in this group is non-empty
+        UINT32 pad;
+    };
+
+    int b;			// Bits per index
+
+    UINT64 size;		// Number of bucket groups
+
+    UINT64 n_buckets;	// Number of non-empty buckets
+
+    UINT64 n_items;	// Number of items
+
+    const Group *groups;    // [size]
+    const UINT64 *offsets;  // [n_buckets + 1]
+    const UINT32 *ids;      // [n_items]. NULL if compressed
+    const UINT8 *packed;    // [n_packed]. NULL if not compressed
+
+    UINT64 n_packed;        // Number of bytes of packed, including the padding at the end
+
+    FrozenSparseHashtable();
+    FrozenSparseHashtable(const FrozenSparseHashtable &rhs);
+    FrozenSparseHashtable& operator= (const FrozenSparseHashtable &rhs);
+
+    // Pack all items of table into the flat layout. table is not modified.
+    void freeze(const SparseHashtable &table);
+
+    // Build the table directly from keys, where the n-th item (id = n) has the key keys[n],
+    // i.e., the same result as SparseHashtable::insert(keys[n], n) for all n, then freeze().
+    // Items are sorted by a parallel LSD radix sort (count, prefix-sum, and scatter for
+    // each digit), so each bucket is written exactly once and ids in a bucket are ascending.
+    void bulk_load(int _b, const UINT32 *keys, UINT64 n);
+
+    // Copy src without the items for which removed(id) is true. Buckets that become
+    // empty are dropped, so probes of them are as cheap as those of never-used buckets.
+    // src is not modified, and may be a view. The result is compressed if src is.
+    template <class Pred>
+    void filter(const FrozenSparseHashtable &src, Pred removed);
+
+    // Compress the ids of each bucket in parallel (see above). The items of a bucket are sorted
+    // if they are not ascending. The table can be a view; the result is owned
+    void compress();
+
+    // Refer to arrays in an external buffer without copying.
+    void view(int _b, UINT64 _size, UINT64 _n_buckets, UINT64 _n_items,
+              const Group *_groups, const UINT64 *_offsets, const UINT32 *_ids,
+              const std::shared_ptr<const void> &owner);
+    void view_packed(int _b, UINT64 _size, UINT64 _n_buckets, UINT64 _n_items, UINT64 _n_packed,
+                     const Group *_groups, const UINT64 *_offsets, const UINT8 *_packed,
+                     const std::shared_ptr<const void> &owner);
+
+    // Not available if compressed
+    const UINT32* query(UINT64 index, int *size) const;
+
+    // Available for both. If compressed, the ids are decoded into *buf, which grows as needed.
+    // Otherwise, this is the same as the above
+    const UINT32* query(UINT64 index, int *size, std::vector<UINT32> *buf) const;
+
+    // Call func(index) for each non-empty bucket, in ascending order of index
+    template <class Func>
+    void for_each_index(Func func) const;
+
+    bool is_view() const {return viewing;}
+    bool is_compressed() const {return packed != NULL;}
+
+ private:
+    friend class pqtable::HelperSparseHashtable;
+
+    // Owned storage (empty if this is a view)
+    std::vector<Group> own_groups;
+    std::vector<UINT64> own_offsets;
+    std::vector<UINT32> own_ids;
+    std::vector<UINT8> own_packed;
+
+    bool viewing;
+    std::shared_ptr<const void> view_owner;
+
+    void bind_own(); // Point groups/offsets/ids/packed to the owned storage
+
+    static const int PACK_PADDING = 8; // Zero bytes after the last bucket, so that query() can read 8 bytes at once
+};
+
+inline const UINT32* FrozenSparseHashtable::query(UINT64 index, int *size) const {
+    assert(packed == NULL);
+    const Group &g = groups[index >> 5];
+    UINT32 bit = (UINT32)1 << (index % 32);
+    if (g.empty & bit) {
+        UINT64 r = g.rank + popcnt(g.empty & (bit - 1));
+        *size = (int)(offsets[r + 1] - offsets[r]);
+        return ids + offsets[r];
+    } else {
+        *size = 0;
+        return NULL;
+    }
+}
+
+inline const UINT32* FrozenSparseHashtable::query(UINT64 index, int *size, std::vector<UINT32> *buf) const {
+    if (packed == NULL)
+        return query(index, size);
+    const Group &g = groups[index >> 5];
+    UINT32 bit = (UINT32)1 << (index % 32);
+    if (!(g.empty & bit)) {
+        *size = 0;
+        return NULL;
+    }
+    const UINT8 *p = packed + offsets[g.rank + popcnt(g.empty & (bit - 1))];
+
+    // Header
+    UINT32 n = 0;
+    for (int shift = 0; ; shift += 7) {
+        n |= (UINT32)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            break;
+    }
+    int w = *p++;
+    UINT32 id;
+    memcpy(&id, p, sizeof(UINT32));
+    p += sizeof(UINT32);
+
+    // Differences. Each is read by an unaligned 8-byte load (w + 7 <= 64 bits)
+    if (buf->size() < n)
+        buf->resize(n);
+    UINT32 *out = buf->data();
+    out[0] = id;
+    UINT64 mask = ((UINT64)1 << w) - 1;
+    UINT64 pos = 0;
+    for (UINT32 i = 1; i < n; ++i, pos += w) {
+        UINT64 word;
+        memcpy(&word, p + (pos >> 3), sizeof(UINT64));
+        id += (UINT32)((word >> (pos & 7)) & mask);
+        out[i] = id;
+    }
+    *size = (int) n;
+    return out;
+}
+
+template <class Func>
+void FrozenSparseHashtable::for_each_index(Func func) const {
+    for (UINT64 i = 0; i < size; ++i) {
+        for (UINT32 empty = groups[i].empty; empty != 0; empty &= empty - 1)
+            func((i << 5) + __builtin_ctz(empty));
+    }
+}
+
+template <class Pred>
+void FrozenSparseHashtable::filter(const FrozenSparseHashtable &src, Pred removed) {
+    b = src.b;
+    size = src.size;
+
+    viewing = false;
+    view_owner.reset();
+    own_groups.assign(size, Group());
+    own_offsets.clear();
+    own_offsets.reserve(src.n_buckets + 1);
+    own_ids.clear();
+    own_ids.reserve(src.n_items);
+    own_packed.clear();
+
+    std::vector<UINT32> buf;
+    for (UINT64 i = 0; i < size; ++i) {
+        own_groups[i].rank = own_offsets.size();
+        UINT32 empty = src.groups[i].empty;
+        for (int j = 0; j < 32; ++j) {
+            UINT32 bit = (UINT32)1 << j;
+            if (!(empty & bit))
+                continue;
+            int sz;
+            const UINT32 *bucket = src.query((i << 5) + j, &sz, &buf);
+            UINT64 start = own_ids.size();
+            for (int k = 0; k < sz; ++k)
+                if (!removed(bucket[k]))
+                    own_ids.push_back(bucket[k]);
+            if (own_ids.size() != start) {
+                own_offsets.push_back(start);
+                own_groups[i].empty |= bit;
+            }
+        }
+    }
+    n_buckets = own_offsets.size();
+    n_items = own_ids.size();
+    own_offsets.push_back(own_ids.size()); // sentinel
+    own_offsets.shrink_to_fit();
+    own_ids.shrink_to_fit();
+    bind_own();
+
+    if (src.is_compressed())
+        compress();
+}
+
+#endif
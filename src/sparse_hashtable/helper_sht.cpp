@@ -1,4 +1,5 @@
 #include "helper_sht.h"
+#include <cstring>
 
 namespace pqtable {
 
@@ -172,5 +173,170 @@ void HelperSparseHashtable::Read(const std::string &filename, SparseHashtable *t
 }
 
 
+const char HelperSparseHashtable::FROZEN_MAGIC[8] = {'P', 'Q', 'T', 'F', 'R', 'O', 'Z', '1'};
+
+void HelperSparseHashtable::Write(const std::string &filename, const FrozenSparseHashtable &table)
+{
+    if(table.groups == NULL){
+        std::cerr << "Error: table is empty in HelperShaprseHashtable::Write" << std::endl;
+        assert(0);
+    }
+
+    std::ofstream out(filename, std::ios::binary);
+    if(!out){
+        std::cerr << "Error: cannot open file: " << filename << " in HelperShaprseHashtable::Write" << std::endl;
+        exit(-1);
+    }
+
+    static_assert(sizeof(FrozenHeader) == 64, "FrozenHeader must be 64 bytes");
+    static_assert(sizeof(FrozenSparseHashtable::Group) == 16, "Group must be 16 bytes");
+    FrozenHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FROZEN_MAGIC, sizeof(header.magic));
+    header.b = table.b;
+    header.size = table.size;
+    header.n_buckets = table.n_buckets;
+    header.n_items = table.n_items;
+    header.format = table.is_compressed() ? FORMAT_PACKED : FORMAT_IDS;
+    header.n_packed = table.n_packed;
+
+    // (1) header, (2) groups, (3) offsets, and (4) ids or packed ids
+    out.write((char *) &header, sizeof(header));
+    out.write((char *) table.groups, sizeof(FrozenSparseHashtable::Group) * table.size);
+    out.write((char *) table.offsets, sizeof(UINT64) * (table.n_buckets + 1));
+    if(table.is_compressed()){
+        out.write((char *) table.packed, table.n_packed);
+    }else{
+        out.write((char *) table.ids, sizeof(UINT32) * table.n_items);
+    }
+    if(!out){
+        std::cerr << "Error: failed to write " << filename << " in HelperShaprseHashtable::Write" << std::endl;
+        exit(-1);
+    }
+    out.close();
+}
+
+void HelperSparseHashtable::Read(const std::string &filename, FrozenSparseHashtable *table)
+{
+    assert(table != NULL);
+    std::ifstream in(filename, std::ios::binary);
+    if(!in){
+        std::cerr << "Error: cannot open file: " << filename << " in HelperSparseHashtable::Read" << std::endl;
+        assert(0);
+    }
+
+    FrozenHeader header;
+    in.read((char *) &header, sizeof(header));
+    if(!in || memcmp(header.magic, FROZEN_MAGIC, sizeof(header.magic)) != 0){
+        // Written by SparseHashtable
+        in.clear();
+        in.seekg(0);
+        ReadLegacy(in, table);
+        return;
+    }
+
+    table->b = header.b;
+    table->size = header.size;
+    table->n_buckets = header.n_buckets;
+    table->n_items = header.n_items;
+    table->own_groups.resize(header.size);
+    table->own_offsets.resize(header.n_buckets + 1);
+    in.read((char *) table->own_groups.data(), sizeof(FrozenSparseHashtable::Group) * header.size);
+    in.read((char *) table->own_offsets.data(), sizeof(UINT64) * (header.n_buckets + 1));
+    if(header.format == FORMAT_PACKED){
+        table->own_ids.clear();
+        table->own_packed.resize(header.n_packed);
+        in.read((char *) table->own_packed.data(), header.n_packed);
+    }else{
+        table->own_ids.resize(header.n_items);
+        table->own_packed.clear();
+        in.read((char *) table->own_ids.data(), sizeof(UINT32) * header.n_items);
+    }
+    assert(in);
+    table->viewing = false;
+    table->view_owner.reset();
+    table->bind_own();
+}
+
+void HelperSparseHashtable::Map(const std::string &filename, FrozenSparseHashtable *table, MappedFile::Warmup warmup)
+{
+    assert(table != NULL);
+    std::shared_ptr<MappedFile> file(new MappedFile(filename, warmup));
+
+    if(file->Size() < sizeof(FrozenHeader) || memcmp(file->Data(), FROZEN_MAGIC, sizeof(FROZEN_MAGIC)) != 0){
+        // Written by SparseHashtable. This cannot be mapped
+        file.reset();
+        Read(filename, table);
+        return;
+    }
+
+    FrozenHeader header;
+    memcpy(&header, file->Data(), sizeof(header));
+    const char *p = file->Data() + sizeof(header);
+    const FrozenSparseHashtable::Group *groups = (const FrozenSparseHashtable::Group *) p;
+    p += sizeof(FrozenSparseHashtable::Group) * header.size;
+    const UINT64 *offsets = (const UINT64 *) p;
+    p += sizeof(UINT64) * (header.n_buckets + 1);
+    const char *data = p;
+    p += (header.format == FORMAT_PACKED) ? header.n_packed : sizeof(UINT32) * header.n_items;
+    if(p != file->Data() + file->Size()){
+        std::cerr << "Error: broken file: " << filename << " in HelperSparseHashtable::Map" << std::endl;
+        assert(0);
+    }
+
+    if(header.format == FORMAT_PACKED){
+        table->view_packed(header.b, header.size, header.n_buckets, header.n_items, header.n_packed,
+                           groups, offsets, (const UINT8 *) data, file);
+    }else{
+        table->view(header.b, header.size, header.n_buckets, header.n_items,
+                    groups, offsets, (const UINT32 *) data, file);
+    }
+}
+
+void HelperSparseHashtable::ReadLegacy(std::ifstream &in, FrozenSparseHashtable *table)
+{
+    in.read((char *) &table->b, sizeof(int));
+    in.read((char *) &table->size, sizeof(UINT64));
+
+    table->own_groups.assign(table->size, FrozenSparseHashtable::Group());
+    table->own_offsets.clear();
+    table->own_ids.clear();
+    table->own_packed.clear();
+
+    UINT64 next_group = 0; // groups before next_group have their rank
+    std::vector<UINT32> arr;
+    while(1){
+        UINT32 i; // i-th BucketGroup
+        in.read((char *) &i, sizeof(UINT32));
+        for(; next_group <= i && next_group < table->size; ++next_group){
+            table->own_groups[next_group].rank = table->own_offsets.size();
+        }
+        if(i == table->size){ // sentinel. Finish
+            break;
+        }
+
+        UINT32 header[3]; // empty, sz, sz
+        in.read((char *) header, sizeof(UINT32) * 3);
+        arr.resize(header[1]);
+        in.read((char *) arr.data(), sizeof(UINT32) * arr.size()); // read a group at once
+        assert(in);
+
+        table->own_groups[i].empty = header[0];
+        int totones = popcnt(header[0]);
+        UINT64 base = table->own_ids.size();
+        for(int j = 0; j < totones; ++j){
+            table->own_offsets.push_back(base + arr[j]);
+        }
+        table->own_ids.insert(table->own_ids.end(), arr.begin() + totones + 1, arr.end());
+    }
+    table->own_offsets.push_back(table->own_ids.size()); // sentinel
+
+    table->n_buckets = table->own_offsets.size() - 1;
+    table->n_items = table->own_ids.size();
+    table->viewing = false;
+    table->view_owner.reset();
+    table->bind_own();
 }
 
+
+}
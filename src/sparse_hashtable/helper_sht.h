@@ -11,6 +11,8 @@
 #include <fstream> // for IO
 #include <cassert>
 #include "sparse_hashtable.h"
+#include "frozen_sparse_hashtable.h"
+#include "mapped_file.h"
 
 namespace pqtable {
 
@@ -26,6 +28,31 @@ public:
     static void Write(const std::string &filename, const SparseHashtable &table);
     static void Read(const std::string &filename, SparseHashtable *table);
 
+    // IO for a frozen table. The file is a 64-byte header followed by the raw arrays
+    // (groups, offsets, and ids, or packed ids if compressed), each of which is 8-byte
+    // aligned, so that the file can be memory-mapped and queried in place.
+    // Read() and Map() also accept a file written by Write(const SparseHashtable &),
+    // which is read (copied) into memory.
+    static void Write(const std::string &filename, const FrozenSparseHashtable &table);
+    static void Read(const std::string &filename, FrozenSparseHashtable *table);
+    static void Map(const std::string &filename, FrozenSparseHashtable *table,
+                    MappedFile::Warmup warmup = MappedFile::WARMUP_NONE);
+
+private:
+    struct FrozenHeader{
+        char magic[8];
+        int b;
+        int format;        // FORMAT_IDS or FORMAT_PACKED. 0 for older files
+        UINT64 size;
+        UINT64 n_buckets;
+        UINT64 n_items;
+        UINT64 n_packed;   // The number of bytes of packed ids (FORMAT_PACKED)
+        char reserved[16];
+    };
+    static const char FROZEN_MAGIC[8];
+    enum {FORMAT_IDS = 0, FORMAT_PACKED = 1};
+    static void ReadLegacy(std::ifstream &in, FrozenSparseHashtable *table);
+
 };
 
 }
@@ -20,6 +20,10 @@ int SparseHashtable::init(int _b) {
 }
 
 SparseHashtable::~SparseHashtable () {
+    // table is calloc'd, so the destructors of BucketGroups are not called by free
+    for (UINT64 i = 0; table != NULL && i < size; ++i)
+        if (table[i].group != NULL)
+            delete table[i].group;
     free(table);
 }
 
@@ -0,0 +1,157 @@
+#include "stream_encoder.h"
+#include "utils.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <climits>
+
+namespace pqtable {
+
+namespace {
+
+// A blocking FIFO to pass chunks between stages
+template <typename T>
+class Channel{
+public:
+    void Push(const T &item) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_items.push_back(item);
+        }
+        m_cond.notify_one();
+    }
+    T Pop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]{return !m_items.empty();});
+        T item = m_items.front();
+        m_items.pop_front();
+        return item;
+    }
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<T> m_items;
+};
+
+struct VecChunk{
+    std::vector<float> data; // n x D
+    int n;                   // #vectors. 0 means the end of the stream
+};
+
+struct CodeChunk{
+    std::vector<uchar> data; // n x M
+    int n;                   // #codes. 0 means the end of the stream
+};
+
+}
+
+long long EncodeStream(const PQ &pq, std::string vec_path, std::string ext, std::string code_path,
+                       int chunk_size, long long top_n,
+                       std::function<void(long long)> progress)
+{
+    assert(0 < chunk_size);
+    int D = pq.GetM() * pq.GetDs();
+    int M = pq.GetM();
+
+    // The input is checked before the output is created, so that nothing is written for a wrong input
+    MappedVecs reader(vec_path, ext);
+    if(reader.Dim() != D){
+        std::cerr << "Error: dim mismatch. " << reader.Dim() << " != " << D << " in EncodeStream" << std::endl;
+        exit(1);
+    }
+    long long N = (top_n == -1 || reader.Size() < top_n) ? reader.Size() : top_n;
+    if(INT_MAX < N){ // UcharVecs uses int for N
+        std::cerr << "Error: N must be <= INT_MAX in EncodeStream (use top_n, or split the file). N: " << N << std::endl;
+        exit(1);
+    }
+
+    std::ofstream ofs(code_path, std::ios::binary);
+    if(!ofs.is_open()){
+        std::cerr << "Error: cannot open " << code_path << " in EncodeStream" << std::endl;
+        exit(1);
+    }
+    // Header (N, D). N is filled after all codes are written
+    int header[2] = {0, M};
+    ofs.write((char *) header, sizeof(header));
+
+    // Double buffering. Each chunk circulates as free -> full -> free
+    VecChunk vec_chunks[2];
+    CodeChunk code_chunks[2];
+    Channel<VecChunk *> free_vecs, full_vecs;
+    Channel<CodeChunk *> free_codes, full_codes;
+    for(int i = 0; i < 2; ++i){
+        vec_chunks[i].data.resize((size_t) chunk_size * D);
+        code_chunks[i].data.resize((size_t) chunk_size * M);
+        free_vecs.Push(&vec_chunks[i]);
+        free_codes.Push(&code_chunks[i]);
+    }
+
+    // (1) Reader. Vectors are read from a memory-mapped file without per-vector allocation
+    std::thread reader_thread([&](){
+        long long n_read = 0;
+        while(1){
+            VecChunk *chunk = free_vecs.Pop();
+            chunk->n = (int) std::min((long long) chunk_size, N - n_read);
+            for(int i = 0; i < chunk->n; ++i){
+                reader.GetFloat(n_read + i, chunk->data.data() + (size_t) i * D);
+            }
+            n_read += chunk->n;
+            bool end = (chunk->n == 0);
+            full_vecs.Push(chunk);
+            if(end){
+                break;
+            }
+        }
+    });
+
+    // (3) Writer
+    std::thread writer_thread([&](){
+        while(1){
+            CodeChunk *chunk = full_codes.Pop();
+            if(chunk->n == 0){
+                break;
+            }
+            ofs.write((char *) chunk->data.data(), (size_t) chunk->n * M);
+            free_codes.Push(chunk);
+        }
+    });
+
+    // (2) Encoder (this thread)
+    long long n_encoded = 0;
+    std::vector<const float *> ptrs(chunk_size);
+    while(1){
+        VecChunk *vecs = full_vecs.Pop();
+        CodeChunk *codes = free_codes.Pop();
+        codes->n = vecs->n;
+        if(vecs->n == 0){ // end
+            full_codes.Push(codes);
+            break;
+        }
+        for(int i = 0; i < vecs->n; ++i){
+            ptrs[i] = vecs->data.data() + (size_t) i * D;
+        }
+        pq.Encode(ptrs.data(), vecs->n, codes->data.data());
+        n_encoded += vecs->n;
+        free_vecs.Push(vecs);
+        full_codes.Push(codes);
+        if(progress){
+            progress(n_encoded);
+        }
+    }
+    reader_thread.join();
+    writer_thread.join();
+
+    // Fill N
+    assert(n_encoded == N);
+    header[0] = (int) n_encoded;
+    ofs.seekp(0);
+    ofs.write((char *) header, sizeof(int));
+    if(!ofs){
+        std::cerr << "Error: failed to write " << code_path << " in EncodeStream" << std::endl;
+        exit(1);
+    }
+    return n_encoded;
+}
+
+}
@@ -0,0 +1,34 @@
+#ifndef PQTABLE_STREAM_ENCODER_H
+#define PQTABLE_STREAM_ENCODER_H
+
+// Streaming encoder: .fvecs/.bvecs file -> PQ codes file (the format of UcharVecs::Write).
+//
+// Three stages run concurrently on chunks of vectors:
+//   reader thread  : reads the next chunk from the vector file
+//   encoder        : encodes the current chunk by the batch encoder of PQ (all cores)
+//   writer thread  : appends the codes of the previous chunk to the code file
+// Each stage owns one of two (double-buffered) chunks at a time, so the disk and the CPUs
+// are busy at the same time, and the peak memory is bounded by the chunk size instead of
+// the number of vectors.
+//
+// Usage:
+//   pqtable::PQ pq(pqtable::PQ::ReadCodewords("codewords.txt"));
+//   long long N = pqtable::EncodeStream(pq, "bigann_base.bvecs", "bvecs", "codes.bin");
+//   pqtable::UcharVecs codes = pqtable::UcharVecs::Map("codes.bin");
+
+#include "pq.h"
+#include <functional>
+
+namespace pqtable {
+
+// Encode the first top_n vectors (all vectors if top_n == -1) of vec_path, whose ext is
+// "fvecs" or "bvecs", and write their codes into code_path. chunk_size vectors are
+// processed at once. Returns the number of encoded vectors.
+// If progress is given, it is called with the number of vectors encoded so far after each chunk.
+long long EncodeStream(const PQ &pq, std::string vec_path, std::string ext, std::string code_path,
+                       int chunk_size = 1000000, long long top_n = -1,
+                       std::function<void(long long)> progress = nullptr);
+
+}
+
+#endif // PQTABLE_STREAM_ENCODER_H
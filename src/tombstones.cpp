@@ -0,0 +1,67 @@
+#include "tombstones.h"
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <cassert>
+
+namespace pqtable {
+
+Tombstones::Tombstones(long long n)
+    : m_n(n), m_words(new std::atomic<uint64_t>[(n + 63) / 64]), m_count(0)
+{
+    assert(0 <= n);
+    for(long long i = 0; i < (n + 63) / 64; ++i){
+        m_words[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+bool Tombstones::Set(long long id)
+{
+    assert(0 <= id && id < m_n);
+    uint64_t bit = (uint64_t) 1 << (id & 63);
+    uint64_t old = m_words[id >> 6].fetch_or(bit, std::memory_order_relaxed);
+    if(old & bit){
+        return false; // Already removed
+    }
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void Tombstones::Write(std::string path) const
+{
+    std::ofstream ofs(path, std::ios::binary);
+    if(!ofs.is_open()){
+        std::cerr << "Error: cannot open " << path << std::endl;
+        assert(0);
+    }
+    long long num_words = (m_n + 63) / 64;
+    std::vector<uint64_t> words(num_words);
+    for(long long i = 0; i < num_words; ++i){
+        words[i] = m_words[i].load(std::memory_order_relaxed);
+    }
+    ofs.write((char *) &m_n, sizeof(long long));
+    ofs.write((char *) words.data(), sizeof(uint64_t) * num_words);
+}
+
+Tombstones::Tombstones(std::string path)
+    : m_n(0), m_count(0)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    if(!ifs.is_open()){
+        std::cerr << "Error: cannot open " << path << std::endl;
+        assert(0);
+    }
+    ifs.read((char *) &m_n, sizeof(long long));
+    long long num_words = (m_n + 63) / 64;
+    std::vector<uint64_t> words(num_words);
+    ifs.read((char *) words.data(), sizeof(uint64_t) * num_words);
+    m_words.reset(new std::atomic<uint64_t>[num_words]);
+    long long count = 0;
+    for(long long i = 0; i < num_words; ++i){
+        m_words[i].store(words[i], std::memory_order_relaxed);
+        count += __builtin_popcountll(words[i]);
+    }
+    m_count.store(count, std::memory_order_relaxed);
+}
+
+}
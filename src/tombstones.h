@@ -0,0 +1,48 @@
+#ifndef PQTABLE_TOMBSTONES_H
+#define PQTABLE_TOMBSTONES_H
+
+// A bitmap of removed ids. Set() and Test() can be called concurrently.
+// Removed ids stay in hash tables until they are compacted, and searches skip them
+// by Test(), which is a single relaxed load.
+//
+// Usage:
+//   Tombstones removed(N);
+//   removed.Set(id);                 /* thread-safe */
+//   if(!removed.Test(id)){ ... }     /* thread-safe */
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+namespace pqtable {
+
+class Tombstones{
+public:
+    explicit Tombstones(long long n);  // No id is removed
+    explicit Tombstones(std::string path);  // Read a file written by Write()
+
+    // Returns true if id is newly removed
+    bool Set(long long id);
+
+    bool Test(long long id) const {
+        return (m_words[id >> 6].load(std::memory_order_relaxed) >> (id & 63)) & 1;
+    }
+
+    long long Count() const {return m_count.load(std::memory_order_relaxed);} // The number of removed ids
+    long long Size() const {return m_n;}
+
+    void Write(std::string path) const;
+
+private:
+    Tombstones(const Tombstones &);            // Copy is prohibited
+    const Tombstones &operator =(const Tombstones &);
+
+    long long m_n;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_words; // [(m_n + 63) / 64]
+    std::atomic<long long> m_count;
+};
+
+}
+
+#endif // PQTABLE_TOMBSTONES_H
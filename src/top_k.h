@@ -0,0 +1,80 @@
+#ifndef PQTABLE_TOP_K_H
+#define PQTABLE_TOP_K_H
+
+// Keeps the k nearest (id, dist) pairs pushed so far, by a bounded max-heap.
+// Push() is O(log k), and the current k-th distance (the threshold that a new
+// item must beat) is available in O(1).
+//
+// Usage:
+//   TopK topk(k);
+//   topk.Push(id, dist);                        /* for each candidate */
+//   if(topk.Full() && topk.Threshold() <= bound) { /* no other item can enter */ }
+//   std::vector<std::pair<int, float> > scores = topk.Sorted();  /* ascending order of dist */
+//   topk.Reset(k);                              /* reuse for the next query */
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <cassert>
+
+namespace pqtable {
+
+class TopK{
+public:
+    TopK() : m_k(1) {}
+    explicit TopK(int k) {Reset(k);}
+
+    // Clear, and start keeping the nearest k. The memory is kept for reuse
+    void Reset(int k) {
+        assert(0 < k);
+        m_k = k;
+        m_heap.clear();
+        m_heap.reserve(k);
+    }
+
+    // Returns true if (id, dist) is kept
+    bool Push(int id, float dist) {
+        if((int) m_heap.size() < m_k){
+            m_heap.emplace_back(id, dist);
+            std::push_heap(m_heap.begin(), m_heap.end(), Less);
+            return true;
+        }
+        if(dist < m_heap.front().second){
+            std::pop_heap(m_heap.begin(), m_heap.end(), Less);
+            m_heap.back() = std::pair<int, float>(id, dist);
+            std::push_heap(m_heap.begin(), m_heap.end(), Less);
+            return true;
+        }
+        return false;
+    }
+
+    bool Full() const {return (int) m_heap.size() == m_k;}
+    int Size() const {return (int) m_heap.size();}
+
+    // The k-th smallest distance so far. FLT_MAX if less than k items were pushed
+    float Threshold() const {return Full() ? m_heap.front().second : FLT_MAX;}
+
+    // Results in ascending order of dist. The heap is consumed
+    std::vector<std::pair<int, float> > Sorted() {
+        std::sort_heap(m_heap.begin(), m_heap.end(), Less);
+        std::vector<std::pair<int, float> > scores;
+        scores.swap(m_heap);
+        return scores;
+    }
+    // The same as above. Written to *scores, so that both buffers can be reused
+    void Sorted(std::vector<std::pair<int, float> > *scores) {
+        std::sort_heap(m_heap.begin(), m_heap.end(), Less);
+        scores->assign(m_heap.begin(), m_heap.end());
+        m_heap.clear();
+    }
+
+private:
+    static bool Less(const std::pair<int, float> &p1, const std::pair<int, float> &p2) {return p1.second < p2.second;}
+
+    int m_k;
+    std::vector<std::pair<int, float> > m_heap; // max-heap on dist
+};
+
+}
+
+#endif // PQTABLE_TOP_K_H
@@ -1,4 +1,6 @@
 #include "utils.h"
+#include <cstring>
+#include <cfloat>
 
 namespace pqtable {
 
@@ -84,20 +86,86 @@ std::vector<float> ItrReader::Next(){
 }
 
 std::vector<std::vector<float> > ReadTopN(std::string filename, std::string ext, int top_n) {
-    std::vector<std::vector<float> > vecs;
-    if(top_n != -1){
-        vecs.reserve(top_n);
-    }
-    ItrReader reader(filename, ext);
-    while(!reader.IsEnd()){
-        if(top_n != -1 && top_n <= (int) vecs.size()){
-            break;
-        }
-        vecs.push_back(reader.Next());
+    // Read from a memory-mapped file in parallel
+    MappedVecs reader(filename, ext);
+    if(top_n == -1 || reader.Size() < top_n){
+        top_n = (int) reader.Size();
+    }
+    std::vector<std::vector<float> > vecs(top_n);
+    #pragma omp parallel for
+    for(int n = 0; n < top_n; ++n){
+        vecs[n] = reader.GetFloat(n);
     }
     return vecs;
 }
 
+MappedVecs::MappedVecs(std::string filename, std::string ext, MappedFile::Warmup warmup)
+    : m_file(new MappedFile(filename, warmup))
+{
+    if(ext == "fvecs"){
+        m_elemType = ELEM_FLOAT;
+        m_elemSize = sizeof(float);
+    }else if(ext == "bvecs"){
+        m_elemType = ELEM_UCHAR;
+        m_elemSize = sizeof(uchar);
+    }else if(ext == "ivecs"){
+        m_elemType = ELEM_INT;
+        m_elemSize = sizeof(int);
+    }else{
+        std::cerr << "Error: strange ext type: " << ext << " in MappedVecs" << std::endl;
+        exit(1);
+    }
+
+    // Each record is (1) D (int) and (2) D elements
+    assert(sizeof(int) <= m_file->Size());
+    memcpy(&m_D, m_file->Data(), sizeof(int));
+    assert(0 < m_D);
+    m_recordSize = sizeof(int) + (long long) m_D * m_elemSize;
+    if(m_file->Size() % m_recordSize != 0){
+        std::cerr << "Error: the size of " << filename << " is not a multiple of the record size "
+                  << "(all vectors must have the same dim) in MappedVecs" << std::endl;
+        exit(1);
+    }
+    m_N = (long long) (m_file->Size() / m_recordSize);
+}
+
+void MappedVecs::GetFloat(long long n, float *out) const
+{
+    assert(0 <= n && n < m_N);
+    const char *p = m_file->Data() + n * m_recordSize + sizeof(int);
+    if(m_elemType == ELEM_FLOAT){
+        memcpy(out, p, sizeof(float) * m_D);
+    }else if(m_elemType == ELEM_UCHAR){
+        const uchar *v = (const uchar *) p;
+        for(int d = 0; d < m_D; ++d){
+            out[d] = static_cast<float>(v[d]);
+        }
+    }else{ // ELEM_INT
+        const int *v = (const int *) p;
+        for(int d = 0; d < m_D; ++d){
+            out[d] = static_cast<float>(v[d]);
+        }
+    }
+}
+
+std::vector<float> MappedVecs::GetFloat(long long n) const
+{
+    std::vector<float> vec(m_D);
+    GetFloat(n, vec.data());
+    return vec;
+}
+
+std::vector<std::pair<long long, long long> > MappedVecs::Split(int num_ranges) const
+{
+    assert(0 < num_ranges);
+    std::vector<std::pair<long long, long long> > ranges(num_ranges);
+    for(int i = 0; i < num_ranges; ++i){
+        ranges[i].first = m_N * i / num_ranges;
+        ranges[i].second = m_N * (i + 1) / num_ranges;
+    }
+    return ranges;
+}
+
 double Elapsed() {
     timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
@@ -126,4 +194,82 @@ void WriteScores(std::string path, const std::vector<std::vector<std::pair<int,
     }
 }
 
+void WriteScoresBinary(std::string path, const std::vector<std::vector<std::pair<int, float> > > &scores)
+{
+    assert(!scores.empty());
+
+    std::ofstream ofs(path, std::ios::binary);
+    if(!ofs.is_open()){
+        std::cerr << "Error: cannot open " << path << " in WriteScoresBinary" << std::endl;
+        exit(1);
+    }
+
+    int query_sz = (int) scores.size();
+    int top_k = 0;
+    for(const auto &row : scores){
+        top_k = std::max(top_k, (int) row.size());
+    }
+    std::vector<int> ids((size_t) query_sz * top_k, -1);
+    std::vector<float> dists((size_t) query_sz * top_k, FLT_MAX);
+    for(int q = 0; q < query_sz; ++q){
+        for(int k = 0; k < (int) scores[q].size(); ++k){
+            ids[(size_t) q * top_k + k] = scores[q][k].first;
+            dists[(size_t) q * top_k + k] = scores[q][k].second;
+        }
+    }
+    ofs.write((const char *) &query_sz, sizeof(int));
+    ofs.write((const char *) &top_k, sizeof(int));
+    ofs.write((const char *) ids.data(), sizeof(int) * ids.size());
+    ofs.write((const char *) dists.data(), sizeof(float) * dists.size());
+}
+
+std::vector<std::vector<std::pair<int, float> > > ReadScoresBinary(std::string path)
+{
+    MappedFile file(path);
+    int query_sz, top_k;
+    assert(2 * sizeof(int) <= file.Size());
+    memcpy(&query_sz, file.Data(), sizeof(int));
+    memcpy(&top_k, file.Data() + sizeof(int), sizeof(int));
+    size_t n = (size_t) query_sz * top_k;
+    if(file.Size() != 2 * sizeof(int) + n * (sizeof(int) + sizeof(float))){
+        std::cerr << "Error: the size of " << path << " does not match its header in ReadScoresBinary" << std::endl;
+        exit(1);
+    }
+    const int *ids = (const int *) (file.Data() + 2 * sizeof(int));
+    const float *dists = (const float *) (ids + n);
+
+    std::vector<std::vector<std::pair<int, float> > > scores(query_sz);
+    for(int q = 0; q < query_sz; ++q){
+        scores[q].reserve(top_k);
+        for(int k = 0; k < top_k && ids[(size_t) q * top_k + k] != -1; ++k){
+            scores[q].emplace_back(ids[(size_t) q * top_k + k], dists[(size_t) q * top_k + k]);
+        }
+    }
+    return scores;
+}
+
+std::vector<std::vector<std::pair<int, float> > > ReadScores(std::string path)
+{
+    std::ifstream ifs(path);
+    if(!ifs.is_open()){
+        std::cerr << "Error: cannot open " << path << " in ReadScores" << std::endl;
+        exit(1);
+    }
+
+    int query_sz, top_k;
+    ifs >> query_sz >> top_k;
+    std::vector<std::vector<std::pair<int, float> > > scores(query_sz, std::vector<std::pair<int, float> >(top_k));
+    char comma;
+    for(int q = 0; q < query_sz; ++q){
+        for(int k = 0; k < top_k; ++k){
+            ifs >> scores[q][k].first >> comma >> scores[q][k].second >> comma;
+        }
+    }
+    if(!ifs){
+        std::cerr << "Error: " << path << " is broken in ReadScores" << std::endl;
+        exit(1);
+    }
+    return scores;
+}
+
 }
@@ -4,6 +4,8 @@
 #include <opencv2/opencv.hpp>
 #include <fstream>
 #include <time.h>
+#include <memory>
+#include "mapped_file.h"
 
 
 namespace pqtable {
@@ -77,6 +79,70 @@ std::vector<std::vector<float> > ReadTopN(std::string filename, std::string ext,
 
 
 
+// Memory-mapped reader for .fvecs, .bvecs, or .ivecs files.
+// Vectors are accessed by index without copying or allocation, and
+// several threads can read disjoint ranges of one file in parallel.
+// All vectors in a file must have the same dimension.
+//
+// Usage:
+//   MappedVecs vecs("bigann_base.bvecs", "bvecs");
+//   const uchar *v = vecs.Ptr<uchar>(n);  /* n-th vector (D elements). A view into the file */
+//   std::vector<float> buf(vecs.Dim());
+//   vecs.GetFloat(n, buf.data());         /* n-th vector converted to float */
+//
+//   /* Read in parallel */
+//   std::vector<std::pair<long long, long long> > ranges = vecs.Split(num_threads);
+//   #pragma omp parallel for
+//   for(int i = 0; i < num_threads; ++i){
+//     for(long long n = ranges[i].first; n < ranges[i].second; ++n){ /* use vecs.Ptr<uchar>(n) */ }
+//   }
+class MappedVecs{
+public:
+    // ext must be "fvecs", "bvecs", or "ivecs"
+    MappedVecs(std::string filename, std::string ext,
+               MappedFile::Warmup warmup = MappedFile::WARMUP_NONE);
+
+    long long Size() const {return m_N;}
+    int Dim() const {return m_D;}
+
+    // View of the n-th vector. T must be float (fvecs), uchar (bvecs), or int (ivecs)
+    template <typename T>
+    const T *Ptr(long long n) const {
+        assert(sizeof(T) == (size_t) m_elemSize);
+        assert(0 <= n && n < m_N);
+        return (const T *) (m_file->Data() + n * m_recordSize + sizeof(int)); // skip "D" of each record
+    }
+
+    // Copy the n-th vector into out (Dim() floats), converting the element type to float
+    void GetFloat(long long n, float *out) const;
+    std::vector<float> GetFloat(long long n) const;
+
+    // Hints for random accesses. Prefetch() loads the n-th vector into the CPU cache asynchronously,
+    // and WillNeed() its pages from the disk (see MappedFile::WillNeed)
+    void Prefetch(long long n) const {
+        const char *p = m_file->Data() + n * m_recordSize;
+        for(long long i = 0; i < m_recordSize; i += 64){
+            __builtin_prefetch(p + i);
+        }
+    }
+    void WillNeed(long long n) const {m_file->WillNeed((size_t) (n * m_recordSize), (size_t) m_recordSize);}
+
+    // Split [0, Size()) into num_ranges contiguous ranges (begin, end) of nearly equal sizes
+    std::vector<std::pair<long long, long long> > Split(int num_ranges) const;
+
+private:
+    MappedVecs();
+    enum ElemType {ELEM_FLOAT, ELEM_UCHAR, ELEM_INT}; // fvecs, bvecs, ivecs
+    std::shared_ptr<MappedFile> m_file;
+    ElemType m_elemType;                                // Resolved from ext once, for GetFloat
+    long long m_N;
+    int m_D;
+    int m_elemSize;
+    long long m_recordSize; // sizeof(int) + D * m_elemSize
+};
+
+
+
 
 
 
@@ -97,6 +163,17 @@ double Elapsed();
 void WriteScores(std::string path,
                  const std::vector<std::vector<std::pair<int, float> > > &scores);
 
+// Binary version of WriteScores, which is much faster to write and read for many queries or a large top_k.
+// Format: Q (int32), top_k (int32), Q * top_k ids (int32, row-major), then Q * top_k distances (float32).
+// A query with less than top_k results is padded with (-1, FLT_MAX), which ReadScoresBinary removes.
+// Read by ReadScoresBinary, tools/pqtable_eval, and scripts/eval.py
+void WriteScoresBinary(std::string path,
+                       const std::vector<std::vector<std::pair<int, float> > > &scores);
+std::vector<std::vector<std::pair<int, float> > > ReadScoresBinary(std::string path);
+
+// Read a file written by WriteScores
+std::vector<std::vector<std::pair<int, float> > > ReadScores(std::string path);
+
 
 }
 
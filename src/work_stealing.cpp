@@ -0,0 +1,88 @@
+#include "work_stealing.h"
+#include <omp.h>
+#include <atomic>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+
+namespace pqtable {
+
+namespace {
+
+// A range [begin, end) packed into a single 64-bit word so that the owner (pop
+// from the front) and thieves (split from the back) can update it by one CAS.
+inline uint64_t PackRange(uint32_t begin, uint32_t end) {
+    return ((uint64_t) begin << 32) | end;
+}
+inline uint32_t RangeBegin(uint64_t range) { return (uint32_t) (range >> 32); }
+inline uint32_t RangeEnd(uint64_t range) { return (uint32_t) range; }
+
+// Each slot sits on its own cache line to avoid false sharing among threads
+struct alignas(64) RangeSlot {
+    std::atomic<uint64_t> range;
+};
+
+}
+
+void ParallelForWorkStealing(int n, const std::function<void(int)> &body, int num_threads)
+{
+    assert(0 <= n);
+    if(n == 0){
+        return;
+    }
+    if(num_threads == -1){
+        num_threads = omp_get_max_threads();
+    }
+    if(n < num_threads){
+        num_threads = n;
+    }
+    assert(0 < num_threads);
+
+    // Initial static partition. Ranges are rebalanced by stealing afterwards
+    std::vector<RangeSlot> slots(num_threads);
+    for(int t = 0; t < num_threads; ++t){
+        uint32_t begin = (uint32_t) ((long long) n * t / num_threads);
+        uint32_t end = (uint32_t) ((long long) n * (t + 1) / num_threads);
+        slots[t].range.store(PackRange(begin, end));
+    }
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        int tid = omp_get_thread_num();
+        std::atomic<uint64_t> &mine = slots[tid].range;
+
+        while(1){
+            // (1) Pop from the front of the own range
+            uint64_t r = mine.load();
+            if(RangeBegin(r) < RangeEnd(r)){
+                if(mine.compare_exchange_weak(r, PackRange(RangeBegin(r) + 1, RangeEnd(r)))){
+                    body((int) RangeBegin(r));
+                }
+                continue;
+            }
+
+            // (2) The own range is empty. Steal the back half of someone else's range
+            bool stolen = false;
+            for(int i = 1; i < num_threads && !stolen; ++i){
+                std::atomic<uint64_t> &victim = slots[(tid + i) % num_threads].range;
+                uint64_t v = victim.load();
+                while(RangeBegin(v) < RangeEnd(v)){
+                    uint32_t len = RangeEnd(v) - RangeBegin(v);
+                    uint32_t mid = RangeEnd(v) - (len + 1) / 2;
+                    if(victim.compare_exchange_weak(v, PackRange(RangeBegin(v), mid))){
+                        mine.store(PackRange(mid, RangeEnd(v))); // Nobody steals from an empty slot, so simply store
+                        stolen = true;
+                        break;
+                    }
+                }
+            }
+
+            // (3) All ranges are empty. Items that are in flight are processed by their owners
+            if(!stolen){
+                break;
+            }
+        }
+    }
+}
+
+}
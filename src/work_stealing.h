@@ -0,0 +1,28 @@
+#ifndef PQTABLE_WORK_STEALING_H
+#define PQTABLE_WORK_STEALING_H
+
+// Work-stealing parallel for-loop.
+//
+// The items [0, n) are first split into one contiguous range per thread.
+// Each thread pops items from the front of its own range. When its range is
+// empty, the thread steals the back half of the range of another thread and
+// continues from there. Since the cost of an item (e.g., a query) can vary by
+// orders of magnitude, this keeps all cores busy until the very end, whereas
+// a static schedule leaves cores idle behind a few slow items.
+//
+// Usage:
+//   std::vector<float> results(n);
+//   pqtable::ParallelForWorkStealing(n, [&](int i){
+//       results[i] = SomeHeavyFunc(i);  /* body must be thread-safe */
+//   });
+
+#include <functional>
+
+namespace pqtable {
+
+// If num_threads == -1, omp_get_max_threads() threads are used
+void ParallelForWorkStealing(int n, const std::function<void(int)> &body, int num_threads = -1);
+
+}
+
+#endif // PQTABLE_WORK_STEALING_H
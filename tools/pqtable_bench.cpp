@@ -0,0 +1,351 @@
+// End-to-end benchmark of PQTable.
+//
+// Builds (or loads) an index, then reports the build/load time, recall@R against the ground truth,
+// the latency percentiles and the QPS for each number of threads, and the peak RSS.
+// The results are printed, and optionally written as JSON.
+//
+// Usage:
+//   /* Offline. Clustered synthetic data, whose ground truth is computed by brute force */
+//   $ ./pqtable_bench --synthetic 100000 --dim 128 --M 8 --top_k 100 --json result.json
+//
+//   /* Real data (e.g., siftsmall). The ground truth is an .ivecs file (the first id of each row is used) */
+//   $ ./pqtable_bench --base siftsmall_base.fvecs --learn siftsmall_learn.fvecs
+//                     --query siftsmall_query.fvecs --gt siftsmall_groundtruth.ivecs --ext fvecs --M 4
+//
+//   /* A built index (a dir written by PQTable::Write). The load time is measured. For a cold load, */
+//   /* drop the page cache first (e.g., "sync; echo 3 > /proc/sys/vm/drop_caches" as root) */
+//   $ ./pqtable_bench --index pqtable --query bigann_query.bvecs --gt idx_1000M.ivecs --ext bvecs
+//
+// Options (default):
+//   Data      --synthetic N | --base PATH | --index DIR
+//             --dim (128) --clusters (100) --num_learn (10000) --num_queries (1000) --seed (0)   for --synthetic
+//             --learn PATH (--base) --query PATH --gt PATH --ext (fvecs) --num_base (all)           for files
+//   Index     --M (8) --Ks (256) --T (-1) --compress --save DIR (write the index, and measure its load time,
+//             which is a warm one since the files were just written)
+//   Workload  --top_k (100) --threads (1,2,4,... up to all cores) --repeat (1) --max_msec (-1) --scan_ratio (0.2)
+//             --schedule (default: the table's) round_robin | nearest_first | cost_aware   for multi-tables
+//   Output    --json PATH ("-" for stdout. Then the progress is printed to stderr, so stdout is only the JSON)
+
+#include "pq_table.h"
+#include "evaluation.h"
+#include "utils.h"
+#include <omp.h>
+#include <map>
+#include <numeric>
+#include <random>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <sys/resource.h>
+
+
+// --key value options. A key without a value (e.g., --compress) is "1"
+class Options{
+public:
+    Options(int argc, char *argv[]) {
+        for(int i = 1; i < argc; ++i){
+            std::string key = argv[i];
+            if(key.substr(0, 2) != "--"){
+                std::cerr << "Error: strange option: " << key << std::endl;
+                exit(1);
+            }
+            if(i + 1 < argc && std::string(argv[i + 1]).substr(0, 2) != "--"){
+                m_values[key.substr(2)] = argv[++i];
+            }else{
+                m_values[key.substr(2)] = "1";
+            }
+        }
+    }
+    bool Has(std::string key) const {return m_values.count(key) != 0;}
+    std::string Str(std::string key, std::string def) const {return Has(key) ? m_values.at(key) : def;}
+    long long Int(std::string key, long long def) const {return Has(key) ? std::stoll(m_values.at(key)) : def;}
+    double Double(std::string key, double def) const {return Has(key) ? std::stod(m_values.at(key)) : def;}
+
+private:
+    std::map<std::string, std::string> m_values;
+};
+
+// Clustered data: each vector is a random center plus N(0, 1) noise, where the centers are drawn from
+// N(0, 4^2) once for a seed. So base, learn, and query vectors follow the same distribution
+class SyntheticData{
+public:
+    SyntheticData(int D, int num_clusters, unsigned long long seed) : m_rng(seed) {
+        std::normal_distribution<float> spread(0, 4);
+        m_centers.resize(num_clusters, std::vector<float>(D));
+        for(auto &center : m_centers){
+            for(auto &x : center){
+                x = spread(m_rng);
+            }
+        }
+    }
+    std::vector<std::vector<float> > Generate(long long n) {
+        std::normal_distribution<float> noise(0, 1);
+        std::uniform_int_distribution<int> pick(0, (int) m_centers.size() - 1);
+        std::vector<std::vector<float> > vecs(n);
+        for(auto &vec : vecs){
+            vec = m_centers[pick(m_rng)];
+            for(auto &x : vec){
+                x += noise(m_rng);
+            }
+        }
+        return vecs;
+    }
+
+private:
+    std::mt19937_64 m_rng;
+    std::vector<std::vector<float> > m_centers;
+};
+
+static double Seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The p-th percentile (0 <= p <= 100) of sorted values, by the nearest rank
+static double Percentile(const std::vector<double> &sorted, double p)
+{
+    int rank = (int) std::ceil(p / 100 * sorted.size());
+    return sorted[std::min(std::max(rank, 1), (int) sorted.size()) - 1];
+}
+
+// Peak resident set size of this process in MB
+static double PeakRssMB()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0; // KB on Linux
+}
+
+// Thread counts: 1, 2, 4, ... up to all cores (and all cores themselves), or "1,2,8"
+static std::vector<int> ThreadCounts(std::string spec)
+{
+    std::vector<int> counts;
+    if(spec.empty()){
+        int max_threads = omp_get_max_threads();
+        for(int t = 1; t < max_threads; t *= 2){
+            counts.push_back(t);
+        }
+        counts.push_back(max_threads);
+    }else{
+        std::stringstream ss(spec);
+        std::string item;
+        while(std::getline(ss, item, ',')){
+            counts.push_back(std::stoi(item));
+        }
+    }
+    return counts;
+}
+
+struct Run{
+    int num_threads;
+    double qps;
+    double mean_ms, p50_ms, p90_ms, p99_ms, p999_ms;
+};
+
+// Search all queries repeat times with num_threads. Each thread keeps its own context
+static Run Measure(const pqtable::PQTable &table, const cv::Mat &queries, int top_k,
+                   const pqtable::SearchParams &params, int num_threads, int repeat)
+{
+    int Q = queries.rows;
+    std::vector<double> latencies((size_t) Q * repeat);
+    std::vector<pqtable::QueryContext> ctxs(num_threads);
+    std::vector<std::vector<std::pair<int, float> > > scores(num_threads);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pqtable::ParallelForWorkStealing(Q * repeat, [&](int i){
+        int tid = omp_get_thread_num();
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        table.Query(&ctxs[tid], queries.ptr<float>(i % Q), top_k, &scores[tid], params);
+        latencies[i] = Seconds(t0) * 1000;
+    }, num_threads);
+    double sec = Seconds(start);
+
+    std::sort(latencies.begin(), latencies.end());
+    Run run;
+    run.num_threads = num_threads;
+    run.qps = latencies.size() / sec;
+    run.mean_ms = std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+    run.p50_ms = Percentile(latencies, 50);
+    run.p90_ms = Percentile(latencies, 90);
+    run.p99_ms = Percentile(latencies, 99);
+    run.p999_ms = Percentile(latencies, 99.9);
+    return run;
+}
+
+
+int main(int argc, char *argv[]){
+    Options opt(argc, argv);
+
+    // The JSON file is opened first, so that a wrong path does not waste a run. With "-", everything
+    // else written to stdout (also by the library, e.g., PQ::Learn) goes to stderr
+    std::ofstream json_file;
+    std::ostream json_out(std::cout.rdbuf());
+    if(opt.Str("json", "") == "-"){
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }else if(opt.Has("json")){
+        json_file.open(opt.Str("json", ""));
+        if(!json_file.is_open()){
+            std::cerr << "Error: cannot open " << opt.Str("json", "") << " for --json" << std::endl;
+            exit(1);
+        }
+        json_out.rdbuf(json_file.rdbuf());
+    }
+
+    int top_k = (int) opt.Int("top_k", 100);
+    int repeat = (int) opt.Int("repeat", 1);
+    pqtable::SearchParams params;
+    params.max_msec = opt.Double("max_msec", -1);
+    params.scan_ratio = opt.Double("scan_ratio", params.scan_ratio);
+    if(opt.Has("schedule")){
+        const char *names[] = {"round_robin", "nearest_first", "cost_aware"}; // In the order of PQMultiTable::Schedule
+        for(int s = 0; s < 3; ++s){
+            if(opt.Str("schedule", "") == names[s]){
+                params.schedule = s;
+            }
+        }
+        if(params.schedule == -1){
+            std::cerr << "Error: strange schedule: " << opt.Str("schedule", "") << std::endl;
+            exit(1);
+        }
+    }
+    std::stringstream config; // The data and the index, for the JSON output
+
+    // (1) Data. base_vecs is empty for a built index
+    std::vector<std::vector<float> > learn_vecs, base_vecs, query_vecs;
+    std::vector<int> gt; // The nearest id of each query. Empty if unknown
+    if(opt.Has("synthetic")){
+        int D = (int) opt.Int("dim", 128);
+        SyntheticData data(D, (int) opt.Int("clusters", 100), (unsigned long long) opt.Int("seed", 0));
+        learn_vecs = data.Generate(opt.Int("num_learn", 10000));
+        base_vecs = data.Generate(opt.Int("synthetic", 0));
+        query_vecs = data.Generate(opt.Int("num_queries", 1000));
+        std::cout << "=== Compute the ground truth by brute force ===" << std::endl;
+        for(const auto &row : pqtable::ExactSearch(base_vecs, query_vecs, 1)){
+            gt.push_back(row[0].first);
+        }
+        config << "\"data\": \"synthetic\", \"dim\": " << D << ", \"clusters\": " << opt.Int("clusters", 100)
+               << ", \"seed\": " << opt.Int("seed", 0) << ", ";
+    }else if(opt.Has("base") || opt.Has("index")){
+        std::string ext = opt.Str("ext", "fvecs");
+        if(opt.Has("base")){
+            base_vecs = pqtable::ReadTopN(opt.Str("base", ""), ext, (int) opt.Int("num_base", -1));
+            learn_vecs = pqtable::ReadTopN(opt.Str("learn", opt.Str("base", "")), ext, (int) opt.Int("num_learn", 10000));
+        }
+        query_vecs = pqtable::ReadTopN(opt.Str("query", ""), ext, (int) opt.Int("num_queries", -1));
+        if(opt.Has("gt")){
+            gt = pqtable::ReadNearestIds(opt.Str("gt", ""));
+        }
+        config << "\"data\": \"" << (opt.Has("index") ? opt.Str("index", "") : opt.Str("base", "")) << "\", ";
+    }else{
+        std::cerr << "Error: give --synthetic N, --base PATH, or --index DIR" << std::endl;
+        exit(1);
+    }
+    assert(!query_vecs.empty());
+
+    // (2) Index. Either built from base_vecs or loaded
+    std::unique_ptr<pqtable::PQTable> table;
+    double train_sec = -1, encode_sec = -1, build_sec = -1, load_sec = -1, warm_load_sec = -1;
+    int M = (int) opt.Int("M", 8), Ks = (int) opt.Int("Ks", 256), T = (int) opt.Int("T", -1);
+    bool compress = opt.Has("compress");
+    if(opt.Has("index")){
+        std::cout << "=== Load the index ===" << std::endl;
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        table.reset(new pqtable::PQTable(opt.Str("index", "")));
+        load_sec = Seconds(t0);
+    }else{
+        std::cout << "=== Train a product quantizer ===" << std::endl;
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        pqtable::PQ pq(pqtable::PQ::Learn(learn_vecs, M, Ks));
+        train_sec = Seconds(t0);
+
+        std::cout << "=== Encode vectors into PQ codes ===" << std::endl;
+        t0 = std::chrono::steady_clock::now();
+        pqtable::UcharVecs codes = pq.Encode(base_vecs);
+        encode_sec = Seconds(t0);
+        std::vector<std::vector<float> >().swap(base_vecs); // Not needed any more
+
+        std::cout << "=== Build PQTable ===" << std::endl;
+        t0 = std::chrono::steady_clock::now();
+        table.reset(new pqtable::PQTable(pq.GetCodewords(), codes, T, compress));
+        build_sec = Seconds(t0);
+
+        if(opt.Has("save")){
+            table->Write(opt.Str("save", ""));
+            t0 = std::chrono::steady_clock::now();
+            pqtable::PQTable loaded(opt.Str("save", ""));
+            warm_load_sec = Seconds(t0); // The files are still in the page cache
+        }
+    }
+    if(!opt.Has("index")){ // Unknown for a built index
+        config << "\"M\": " << M << ", \"Ks\": " << Ks << ", \"T\": " << T << ", \"compress\": " << (compress ? "true" : "false") << ", ";
+    }
+    config << "\"N\": " << table->Size() << ", \"segments\": " << table->NumSegments()
+           << ", \"num_queries\": " << query_vecs.size() << ", \"top_k\": " << top_k
+           << ", \"max_msec\": " << params.max_msec << ", \"scan_ratio\": " << params.scan_ratio
+           << ", \"schedule\": \"" << opt.Str("schedule", "default") << "\""
+           << ", \"simd\": \"" << pqtable::SimdLevel() << "\"";
+
+    // (3) Recall@R, i.e., the ratio of queries whose nearest id is in the top-R results (as scripts/eval.py),
+    // and the work per query. This also warms up the caches
+    std::cout << "=== Search ===" << std::endl;
+    cv::Mat queries = pqtable::PQ::ArrayToMat(query_vecs);
+    std::vector<std::pair<int, double> > recalls; // (R, recall@R)
+    pqtable::SearchStats stats;
+    {
+        std::vector<std::vector<std::pair<int, float> > > scores(query_vecs.size());
+        pqtable::QueryContext ctx;
+        for(int q = 0; q < (int) query_vecs.size(); ++q){
+            table->Query(&ctx, queries.ptr<float>(q), top_k, &scores[q], params, NULL, &stats);
+        }
+        for(int R : {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000}){
+            if(R <= top_k && !gt.empty()){
+                recalls.push_back(std::make_pair(R, pqtable::RecallAtR(scores, gt, R)));
+            }
+        }
+    }
+
+    // (4) Latency and QPS for each number of threads
+    std::vector<Run> runs;
+    for(int num_threads : ThreadCounts(opt.Str("threads", ""))){
+        runs.push_back(Measure(*table, queries, top_k, params, num_threads, repeat));
+        const Run &r = runs.back();
+        std::cout << "threads=" << r.num_threads << " QPS=" << r.qps << " latency [msec] mean=" << r.mean_ms
+                  << " p50=" << r.p50_ms << " p90=" << r.p90_ms << " p99=" << r.p99_ms << " p99.9=" << r.p999_ms << std::endl;
+    }
+
+    // (5) Report
+    for(const auto &recall : recalls){
+        std::cout << "Recall@" << recall.first << ": " << recall.second << std::endl;
+    }
+    double probes = (double) stats.num_probes / query_vecs.size();
+    double verified = (double) stats.num_verified / query_vecs.size();
+    std::cout << "probes/query: " << probes << ", verified/query: " << verified << std::endl;
+    std::cout << "train: " << train_sec << " [sec], encode: " << encode_sec << " [sec], build: " << build_sec
+              << " [sec], load: " << load_sec << " [sec], warm load (--save): " << warm_load_sec << " [sec] (-1: not measured)" << std::endl;
+    std::cout << "peak RSS: " << PeakRssMB() << " [MB]" << std::endl;
+
+    if(opt.Has("json")){
+        std::stringstream json;
+        json << std::setprecision(6);
+        json << "{\n  \"config\": {" << config.str() << "},\n";
+        json << "  \"train_sec\": " << train_sec << ", \"encode_sec\": " << encode_sec
+             << ", \"build_sec\": " << build_sec << ", \"load_sec\": " << load_sec << ", \"warm_load_sec\": " << warm_load_sec << ",\n";
+        json << "  \"peak_rss_mb\": " << PeakRssMB() << ",\n";
+        json << "  \"probes_per_query\": " << probes << ", \"verified_per_query\": " << verified << ",\n";
+        json << "  \"recall\": {";
+        for(int i = 0; i < (int) recalls.size(); ++i){
+            json << (i ? ", " : "") << "\"" << recalls[i].first << "\": " << recalls[i].second;
+        }
+        json << "},\n  \"runs\": [\n";
+        for(int i = 0; i < (int) runs.size(); ++i){
+            const Run &r = runs[i];
+            json << "    {\"threads\": " << r.num_threads << ", \"qps\": " << r.qps
+                 << ", \"latency_ms\": {\"mean\": " << r.mean_ms << ", \"p50\": " << r.p50_ms << ", \"p90\": " << r.p90_ms
+                 << ", \"p99\": " << r.p99_ms << ", \"p999\": " << r.p999_ms << "}}" << (i + 1 < (int) runs.size() ? "," : "") << "\n";
+        }
+        json << "  ]\n}\n";
+
+        json_out << json.str();
+    }
+
+    return 0;
+}
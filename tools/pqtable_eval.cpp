@@ -0,0 +1,42 @@
+// Recall@R of search results against a ground truth, the same as scripts/eval.py but fast.
+//
+// Usage:
+//   $ ./pqtable_eval score.bin ../../data/gnd/idx_1000M.ivecs
+//
+// The scores are written by WriteScoresBinary (or by WriteScores, if the file name ends with ".txt").
+// Recall@R is the ratio of queries whose nearest id (the first one of each row of the ground truth)
+// is in the top-R results
+
+#include "evaluation.h"
+#include <iomanip>
+
+
+int main(int argc, char *argv[]){
+    if(argc != 3){
+        std::cerr << "Usage: " << argv[0] << " SCORES GROUNDTRUTH.ivecs" << std::endl;
+        return 1;
+    }
+    std::string score_path = argv[1];
+    bool is_text = 4 <= score_path.size() && score_path.substr(score_path.size() - 4) == ".txt";
+    std::vector<std::vector<std::pair<int, float> > > scores =
+            is_text ? pqtable::ReadScores(score_path) : pqtable::ReadScoresBinary(score_path);
+    std::vector<int> nearest_ids = pqtable::ReadNearestIds(argv[2]);
+    if(nearest_ids.size() < scores.size()){
+        std::cerr << "Error: the ground truth has " << nearest_ids.size() << " queries, but the scores have "
+                  << scores.size() << std::endl;
+        return 1;
+    }
+
+    int top_k = 0;
+    for(const auto &row : scores){
+        top_k = std::max(top_k, (int) row.size());
+    }
+    for(int R : {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000}){
+        if(R <= top_k){
+            std::cout << "Recall@" << R << ": " << std::fixed << std::setprecision(3)
+                      << pqtable::RecallAtR(scores, nearest_ids, R) << std::endl;
+        }
+    }
+
+    return 0;
+}
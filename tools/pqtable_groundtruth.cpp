@@ -0,0 +1,36 @@
+// Exact k-NN ground truth for a custom dataset, by multi-threaded SIMD brute force over
+// memory-mapped base vectors (see evaluation.h).
+//
+// Usage:
+//   $ ./pqtable_groundtruth BASE QUERY EXT TOP_K OUT.ivecs [OUT_DIST.fvecs] [NUM_THREADS]
+//   $ ./pqtable_groundtruth ../../data/bigann_base.bvecs ../../data/bigann_query.bvecs bvecs 1000 gt.ivecs
+//
+// EXT is "fvecs" or "bvecs" (both files). OUT.ivecs has TOP_K ids per query, in the same format
+// as data/gnd/idx_*.ivecs, and OUT_DIST.fvecs their squared L2 distances
+
+#include "evaluation.h"
+
+
+int main(int argc, char *argv[]){
+    if(argc < 6 || 8 < argc){
+        std::cerr << "Usage: " << argv[0] << " BASE QUERY EXT TOP_K OUT.ivecs [OUT_DIST.fvecs] [NUM_THREADS]" << std::endl;
+        return 1;
+    }
+    std::string ext = argv[3];
+    int top_k = atoi(argv[4]);
+    std::string dist_path = (7 <= argc) ? argv[6] : "";
+    int num_threads = (8 <= argc) ? atoi(argv[7]) : -1;
+
+    pqtable::MappedVecs bases(argv[1], ext);
+    std::vector<std::vector<float> > queries = pqtable::ReadTopN(argv[2], ext);
+    std::cout << "N: " << bases.Size() << ", D: " << bases.Dim() << ", queries: " << queries.size()
+              << ", top_k: " << top_k << std::endl;
+
+    double t0 = pqtable::Elapsed();
+    std::vector<std::vector<std::pair<int, float> > > gt = pqtable::ExactSearch(bases, queries, top_k, num_threads);
+    std::cout << pqtable::Elapsed() - t0 << " [sec]" << std::endl;
+
+    pqtable::WriteGroundTruth(argv[5], gt, dist_path);
+
+    return 0;
+}